@@ -0,0 +1,150 @@
+#pragma once
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "pass.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace PhotoGraph {
+	/*容量固定的阻塞队列 流水线相邻两级之间传递数据*/
+	template <typename T>
+	class BlockingQueue {
+	private:
+		std::deque<T> items_;
+		size_t capacity_;
+		int producers_; /*所有生产者都close之后 pop在队列空时返回false*/
+		std::mutex mutex_;
+		std::condition_variable not_empty_;
+		std::condition_variable not_full_;
+	public:
+		BlockingQueue(size_t capacity, int producers = 1) : capacity_(capacity), producers_(producers) {}
+		void push(const T& item) {
+			std::unique_lock<std::mutex> lock(mutex_);
+			not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+			items_.push_back(item);
+			not_empty_.notify_one();
+		}
+		bool pop(T& item) {
+			std::unique_lock<std::mutex> lock(mutex_);
+			not_empty_.wait(lock, [this] { return !items_.empty() || producers_ == 0; });
+			if (items_.empty()) return false;
+			item = items_.front();
+			items_.pop_front();
+			not_full_.notify_one();
+			return true;
+		}
+		void close() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			producers_--;
+			not_empty_.notify_all();
+		}
+	};
+
+	struct BatchItem {
+		size_t index;
+		Texture* source; /*解码线程创建 处理完成后释放*/
+		Mat result; /*输出的拷贝 编码时Pass已经在处理下一张*/
+		BatchItem() : index(0), source(NULL) {}
+	};
+
+	/*用同一个Pass处理大量图片 只compile一次 每张图片只替换Node_Texture的输入
+	  解码第N+1张 处理第N张 编码第N-1张三者同时进行 处理阶段本身使用全部核心*/
+	class BatchRunner {
+	private:
+		Pass& pass_;
+		std::string texture_node_;
+		int io_threads_; /*解码与编码各自的线程数*/
+		size_t depth_; /*每一级最多缓存的图片数*/
+	public:
+		BatchRunner(Pass& pass, std::string texture_node, int io_threads = 2, size_t depth = 2)
+			: pass_(pass), texture_node_(texture_node), io_threads_(io_threads), depth_(depth) {}
+
+		/*把inputs[i]处理后写入outputs[i] 返回成功写出的图片数
+		  处理中抛出异常时先停止并回收所有线程 恢复Node_Texture之后再抛出*/
+		size_t run(const std::vector<std::string>& inputs, const std::vector<std::string>& outputs) {
+			Node_Texture* node = pass_.getNode<Node_Texture>(texture_node_);
+			if (node == NULL || inputs.size() != outputs.size()) return 0;
+			/*先在单线程中compile 解码线程只读取这里记下的尺寸 之后的compile不会与它们竞争
+			  compile之前Node_Texture可能还没有加载 要恢复的tex在compile之后才能确定*/
+			pass_.work();
+			Texture* original = node->tex;
+			int min_width = node->getMinWidth(), min_height = node->getMinHeight();
+			BlockingQueue<BatchItem> decoded(depth_, io_threads_);
+			BlockingQueue<BatchItem> processed(depth_);
+			std::atomic<size_t> next(0);
+			std::atomic<size_t> written(0);
+			std::vector<std::thread> decoders, encoders;
+			auto finish = [&]() {
+				next = inputs.size(); /*解码线程不再取新的图片*/
+				for (size_t i = decoders.size(); i < (size_t)io_threads_; ++i)
+					decoded.close(); /*没有启动的解码线程*/
+				BatchItem rest;
+				while (decoded.pop(rest))
+					delete rest.source;
+				processed.close();
+				for (int i = 0; i < decoders.size(); ++i)
+					decoders[i].join();
+				for (int i = 0; i < encoders.size(); ++i)
+					encoders[i].join();
+				node->tex = original;
+				pass_.markDirty(texture_node_);
+			};
+
+			BatchItem current;
+			try {
+				for (int i = 0; i < io_threads_; ++i) {
+					decoders.push_back(std::thread([&] {
+						size_t index;
+						while ((index = next++) < inputs.size()) {
+							BatchItem item;
+							item.index = index;
+							int reduction = min_width > 0 ? Texture::reductionFor(inputs[index], min_width, min_height) : 1;
+							item.source = new Texture(inputs[index], reduction);
+							decoded.push(item);
+						}
+						decoded.close();
+					}));
+					encoders.push_back(std::thread([&] {
+						BatchItem item;
+						while (processed.pop(item))
+							if (imwrite(outputs[item.index], item.result)) written++;
+					}));
+				}
+
+				while (decoded.pop(current)) {
+					if (current.source->getPixelWidth() == 0 || current.source->getPixelHeight() == 0) {
+						cout << "failed to decode " << inputs[current.index] << endl;
+						delete current.source;
+						current.source = NULL;
+						continue;
+					}
+					node->tex = current.source;
+					pass_.markDirty(texture_node_);
+					pass_.work();
+					/*3通道的源图没有有效的alpha*/
+					if (current.source->getBytespp() == RGBA) current.result = pass_.getTexture()->toMat().clone();
+					else cvtColor(pass_.getTexture()->toMat(), current.result, COLOR_BGRA2BGR);
+					delete current.source;
+					current.source = NULL;
+					processed.push(current);
+				}
+			}
+			catch (...) {
+				delete current.source;
+				finish();
+				throw;
+			}
+			finish();
+			return written;
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,139 @@
+#pragma once
+
+#ifndef _FUSION_H
+#define _FUSION_H
+
+#include "node.h"
+#include <vector>
+
+namespace PhotoGraph {
+	/*融合后的整条节点链 直接读源Texture的行并写入输出 不经过端口*/
+	class FusedKernel {
+	public:
+		virtual ~FusedKernel() {}
+		/*输出第y行从x0开始的count个像素*/
+		virtual void runRow(Texture* target, int x0, int y, int count, int width, int height) = 0;
+	};
+
+	/*采样后不做任何处理*/
+	struct PassThroughOp {
+		inline Vec4f operator () (const Vec4f& v) const { return v; }
+	};
+
+	static inline void storePixel(unsigned char* p, const Vec4f& v) {
+		Color c = Color(v.r, v.g, v.b, v.a);
+		memcpy(p, c.raw, RGBA);
+	}
+
+	/*Texture -> Sample_Texture -> Op -> Output  Op为节点类提供的逐像素运算*/
+	template <class Op>
+	class FusedSampleKernel : public FusedKernel {
+	private:
+		Texture* src_;
+		Op op_;
+	public:
+		FusedSampleKernel(Texture* src, Op op) : src_(src), op_(op) {}
+		virtual void runRow(Texture* target, int x0, int y, int count, int width, int height) {
+			int tw = src_->getPixelWidth(), th = src_->getPixelHeight(), bpp = src_->getBytespp();
+			float v = (y + 0.5) / height;
+			int sy = v * th;
+			unsigned char* row = sy < th ? src_->getRow(sy) : NULL;
+			unsigned char* dst = target->getRow(y) + x0 * RGBA;
+			for (int i = 0; i < count; ++i, dst += RGBA) {
+				float u = (x0 + i + 0.5) / width;
+				int sx = u * tw;
+				Color c = row != NULL && sx < tw ? Color(row + sx * bpp, bpp) : Color();
+				storePixel(dst, op_(Vec4f(c.r, c.g, c.b, c.a)));
+			}
+		}
+	};
+
+	/*Texture + Matrix3 -> Matrix3_Sample -> Output 三行源数据按卷积核直接累加*/
+	class FusedMatrix3Kernel : public FusedKernel {
+	private:
+		Texture* src_;
+		Matrix3x3 mat_;
+	public:
+		FusedMatrix3Kernel(Texture* src, const Matrix3x3& mat) : src_(src), mat_(mat) {}
+		virtual void runRow(Texture* target, int x0, int y, int count, int width, int height) {
+			int tw = src_->getPixelWidth(), th = src_->getPixelHeight(), bpp = src_->getBytespp();
+			float fy = (float)((y + 0.5) / height) * th;
+			unsigned char* rows[3];
+			for (int j = 0; j < 3; ++j) {
+				int sy = (int)fy + j - 1;
+				rows[j] = sy >= 0 && sy < th ? src_->getRow(sy) : NULL;
+			}
+			unsigned char* dst = target->getRow(y) + x0 * RGBA;
+			for (int n = 0; n < count; ++n, dst += RGBA) {
+				float fx = (float)((x0 + n + 0.5) / width) * tw;
+				Vec4f out(0, 0, 0, 0);
+				for (int i = 0; i < 3; ++i) {
+					int sx = (int)fx + i - 1;
+					if (sx < 0 || sx >= tw) continue;
+					for (int j = 0; j < 3; ++j) {
+						if (rows[j] == NULL) continue;
+						unsigned char* p = rows[j] + sx * bpp;
+						float k = mat_.raw[i][j];
+						out.r += p[0] * k;
+						out.g += p[1] * k;
+						out.b += p[2] * k;
+					}
+				}
+				for (int ch = 0; ch < 3; ++ch) {
+					if (out.raw[ch] > 255) out.raw[ch] = 255;
+					else if (out.raw[ch] < 0) out.raw[ch] = 0;
+				}
+				/*与Node_Matrix3_Sample一致 a取colors[5]即(x, y+1)*/
+				int sx = (int)fx;
+				if (rows[2] != NULL && sx < tw) out.a = Color(rows[2] + sx * bpp, bpp).a;
+				storePixel(dst, out);
+			}
+		}
+	};
+
+	static inline Node* singleUpstream(Node* node) {
+		return node->dependency_set.size() == 1 ? *node->dependency_set.begin() : NULL;
+	}
+
+	/*在剪枝合并后的节点序列上匹配可融合的整条链 不匹配时返回NULL
+	  Sample_Texture的dependency_set只含Texture说明UV未绑定 使用屏幕uv0*/
+	static FusedKernel* matchFusedKernel(const std::vector<Node*>& sequence, Node_Output* output) {
+		if (output == NULL || output->format != PIXEL_8U) return NULL; /*融合核按8位写入*/
+		Node* up = singleUpstream(output);
+		if (up == NULL) return NULL;
+
+		Node_Matrix3_Sample* msample = dynamic_cast<Node_Matrix3_Sample*>(up);
+		if (msample != NULL) {
+			if (sequence.size() != 4 || msample->dependency_set.size() != 2) return NULL;
+			Node_Texture* tnode = NULL;
+			Node_Matrix3* mnode = NULL;
+			std::set<Node*>::iterator it;
+			for (it = msample->dependency_set.begin(); it != msample->dependency_set.end(); it++) {
+				if (tnode == NULL) tnode = dynamic_cast<Node_Texture*>(*it);
+				if (mnode == NULL) mnode = dynamic_cast<Node_Matrix3*>(*it);
+			}
+			if (tnode == NULL || mnode == NULL || tnode->tex == NULL || tnode->tex->isWindowed() || tnode->tex->getLayout() != LINEAR || tnode->tex->getBytespp() < RGB) return NULL;
+			if (tnode->tex->getPixelType() != PIXEL_8U) return NULL;
+			if (tnode->getBorder() != EDGE_CONSTANT) return NULL; /*融合核把图像外当作0*/
+			return new FusedMatrix3Kernel(tnode->tex, mnode->getMatrix());
+		}
+
+		Node_Inverse* inverse = dynamic_cast<Node_Inverse*>(up);
+		Node_Saturation* saturation = dynamic_cast<Node_Saturation*>(up);
+		size_t length = 3;
+		if (inverse != NULL || saturation != NULL) {
+			up = singleUpstream(up);
+			length++;
+		}
+		Node_Sample_Texture* sample = dynamic_cast<Node_Sample_Texture*>(up);
+		if (sample == NULL || sequence.size() != length) return NULL;
+		Node_Texture* tnode = dynamic_cast<Node_Texture*>(singleUpstream(sample));
+		if (tnode == NULL || tnode->tex == NULL || tnode->tex->isWindowed() || tnode->tex->getLayout() != LINEAR || sample->getMode() != SAMPLE_NEAREST) return NULL;
+		if (tnode->tex->getPixelType() != PIXEL_8U) return NULL;
+		if (inverse != NULL) return new FusedSampleKernel<Node_Inverse::Op>(tnode->tex, inverse->op());
+		if (saturation != NULL) return new FusedSampleKernel<Node_Saturation::Op>(tnode->tex, saturation->op());
+		return new FusedSampleKernel<PassThroughOp>(tnode->tex, PassThroughOp());
+	}
+}
+
+#endif
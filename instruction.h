@@ -0,0 +1,38 @@
+#pragma once
+
+#ifndef _INSTRUCTION_H
+#define _INSTRUCTION_H
+
+#include "port.h"
+
+namespace PhotoGraph {
+	class Node;
+
+	enum OpCode {
+		OP_NODE,       /*没有专用指令的节点 调用node->workBatch*/
+		OP_TEXTURE,
+		OP_SAMPLE,
+		OP_INVERSE,
+		OP_SATURATION,
+		OP_GRAY,
+		OP_GRAY2RGB,
+		OP_BINARIZE,
+		OP_MOVE,
+		OP_OUTPUT
+	};
+
+	/*寄存器即ExecutionState中的slot偏移 未绑定的输入为NULL_SLOT*/
+	struct Instruction {
+		OpCode op;
+		size_t dst;
+		size_t src[3];
+		float imm[4];
+		Node* node;
+		Instruction() : op(OP_NODE), dst(NULL_SLOT), node(NULL) {
+			for (int i = 0; i < 3; ++i) src[i] = NULL_SLOT;
+			for (int i = 0; i < 4; ++i) imm[i] = 0;
+		}
+	};
+}
+
+#endif
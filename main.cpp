@@ -27,6 +27,9 @@ void createNode(string type, string name,Pass& examplePass, vector<std::string >
 	else if (type == "Sample Texture") {
 		examplePass.defineNode<Node_Sample_Texture>(name, ss);
 	}
+	else if (type == "Render Texture") {
+		examplePass.defineNode<Node_RenderTexture>(name, ss);
+	}
 	else if (type == "Inverse") {
 		examplePass.defineNode<Node_Inverse>(name,ss);
 	}
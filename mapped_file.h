@@ -0,0 +1,78 @@
+#pragma once
+
+#ifndef _MAPPED_FILE_H
+#define _MAPPED_FILE_H
+
+#include <string>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace PhotoGraph {
+	/*把整个文件映射到内存 按写时复制映射 对内存的修改只在本进程可见 不会写回文件
+	  页面在第一次访问时才从磁盘或系统缓存读入*/
+	class MappedFile {
+	private:
+		unsigned char* data_;
+		size_t size_;
+#ifdef _WIN32
+		HANDLE mapping_;
+		MappedFile(unsigned char* data, size_t size, HANDLE mapping) : data_(data), size_(size), mapping_(mapping) {}
+#else
+		MappedFile(unsigned char* data, size_t size) : data_(data), size_(size) {}
+#endif
+		MappedFile(const MappedFile&);
+		MappedFile& operator = (const MappedFile&);
+
+	public:
+		~MappedFile() {
+#ifdef _WIN32
+			UnmapViewOfFile(data_);
+			CloseHandle(mapping_);
+#else
+			munmap(data_, size_);
+#endif
+		}
+		/*文件不存在或为空时返回NULL*/
+		static MappedFile* open(const std::string& path) {
+#ifdef _WIN32
+			HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (file == INVALID_HANDLE_VALUE) return NULL;
+			LARGE_INTEGER size;
+			HANDLE mapping = NULL;
+			if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+				mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+			CloseHandle(file); /*映射对象持有文件*/
+			if (mapping == NULL) return NULL;
+			void* data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+			if (data == NULL) {
+				CloseHandle(mapping);
+				return NULL;
+			}
+			return new MappedFile((unsigned char*)data, (size_t)size.QuadPart, mapping);
+#else
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0) return NULL;
+			struct stat st;
+			void* data = MAP_FAILED;
+			if (fstat(fd, &st) == 0 && st.st_size > 0)
+				data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			close(fd); /*映射建立后不再需要文件描述符*/
+			if (data == MAP_FAILED) return NULL;
+			return new MappedFile((unsigned char*)data, (size_t)st.st_size);
+#endif
+		}
+		inline unsigned char* data() { return data_; }
+		inline size_t size() { return size_; }
+	};
+}
+
+#endif
@@ -6,9 +6,12 @@
 #include "port.h"
 #include "vec.h"
 #include "texture.h"
+#include "texture_cache.h"
+#include "instruction.h"
 #include <set>
 #include <random>
 #include <sstream>
+#include <typeinfo>
 
 namespace PhotoGraph {
 	class Pass;
@@ -16,6 +19,32 @@ namespace PhotoGraph {
 	struct RuntimeInformation {
 		Vec2f uv0;
 		Vec2i screenPosition;
+		ExecutionState* state; /*当前线程的端口值 节点本身不保存逐像素结果*/
+		int lane; /*当前像素在batch中的位置*/
+	};
+
+	/*一个batch为同一行上从x0开始每隔stride个像素取一个 共count个像素*/
+	struct BatchInformation {
+		ExecutionState* state;
+		int x0, y;
+		int count;
+		int width, height; /*输出尺寸 用于计算uv0*/
+		int stride; /*渐进式渲染的粗糙层级大于1*/
+		BatchInformation() : state(NULL), x0(0), y(0), count(0), width(0), height(0), stride(1) {}
+		inline int x(int lane) const {
+			return x0 + lane * stride;
+		}
+		inline Vec2f uv0(int lane) const {
+			return Vec2f((x(lane) + 0.5) / width, (y + 0.5) / height);
+		}
+		inline RuntimeInformation at(int lane) const {
+			RuntimeInformation rinfo;
+			rinfo.uv0 = uv0(lane);
+			rinfo.screenPosition = Vec2i(x(lane), y);
+			rinfo.state = state;
+			rinfo.lane = lane;
+			return rinfo;
+		}
 	};
 
 	class Node {
@@ -23,46 +52,124 @@ namespace PhotoGraph {
 		InputPortMap ipm;
 		OutputPortMap opm;
 	protected:
+		/*端口在definePorts时解析为指针 逐像素路径上不再按名字查找*/
+		template <typename T>
+		inline T getInput(const RuntimeInformation& rinfo, InputPort<T>* port) {
+			return port->getValue(rinfo.state, rinfo.lane);
+		}
+		template <typename T>
+		inline void setOutput(const RuntimeInformation& rinfo, OutputPort<T>* port, T value) {
+			port->setValue(rinfo.state, rinfo.lane, value);
+		}
+		/*batch接口按SoA访问整个batch的端口值*/
 		template <typename T>
-		inline T getInput(std::string port_name) {
-			return ipm.getInput<T>(port_name);
+		inline Lanes<T>& getLanes(const BatchInformation& binfo, InputPort<T>* port) {
+			return port->getLanes(binfo.state);
 		}
 		template <typename T>
-		inline void setOutput(std::string port_name, T value) {
-			return opm.setOutput<T>(port_name, value);
+		inline Lanes<T>& getLanes(const BatchInformation& binfo, OutputPort<T>* port) {
+			return port->getLanes(binfo.state);
 		}
-		inline bool isBinded(std::string port_name) {
-			return ipm.getInputPort<int>(port_name)->isBinded();
+		inline bool isBinded(InputPortBase* port) {
+			return port->isBinded();
 		}
 		template <typename T>
-		inline void defineInputPort(std::string port_name) {
-			ipm.defineInputPort<T>(port_name);
+		inline InputPort<T>* defineInputPort(std::string port_name) {
+			return ipm.defineInputPort<T>(port_name);
 		}
 		template <typename T>
-		inline void defineOutputPort(std::string port_name) {
-			opm.defineOutputPort<T>(port_name);
+		inline OutputPort<T>* defineOutputPort(std::string port_name) {
+			return opm.defineOutputPort<T>(port_name);
 		}
 	public:
 		virtual void definePorts() {} /*在这个函数中定义输入端口和输出端口*/
 		virtual void work(RuntimeInformation rinfo) {} /*定义具体操作*/
+		/*一次处理一个batch 默认逐像素调用work 逐点运算的节点可重写为SoA循环*/
+		virtual void workBatch(const BatchInformation& binfo) {
+			for (int i = 0; i < binfo.count; ++i)
+				work(binfo.at(i));
+		}
+		/*输出是否随像素变化 不变的节点每次渲染只求值一次 默认保守地认为会变化*/
+		virtual bool isVarying() { return true; }
+		/*相同输入下输出是否总是相同 随机节点不能合并*/
+		virtual bool isDeterministic() { return true; }
+		/*类型与属性相同的节点signature相同 用于合并重复节点*/
+		virtual std::string signature() {
+			std::string sig = typeid(*this).name();
+			for (int i = 0; i < attributes.size(); ++i)
+				sig += "|" + attributes[i];
+			return sig;
+		}
+		/*采样输入纹理的位置与当前像素对应位置的最大距离(源纹理像素) 流式渲染据此决定读入的边缘宽度
+		  采样位置由UV输入决定时无法确定 返回-1*/
+		virtual int sampleRadius() { return 0; }
+		/*有直接按通道处理PLANAR纹理的batch实现时返回true 上游纹理据此改用PLANAR布局*/
+		virtual bool prefersPlanar() { return false; }
+		/*编译成Program时填写指令 返回false则以OP_NODE调用workBatch*/
+		virtual bool lower(Instruction& ins) { return false; }
 		virtual void setAttributes(vector<string>ss ){}
+		std::vector<std::string> attributes; /*defineNode时传入的属性*/
 		std::set<Node*> binded_set;
 		std::set<Node*> dependency_set;
 		Node(vector<string> ss) { definePorts(); }
 		Node() { definePorts(); }
 		void bind(std::string output_port, Node* input_node, std::string input_port) {
-			input_node->ipm.getInputPort<int>(input_port)->bind(opm.getOutputPort<int>(output_port));
+			input_node->ipm.getPort(input_port)->bind(opm.getPort(output_port));
 			binded_set.insert(input_node);
 			input_node->dependency_set.insert(this);
 		}
+		/*为输出端口分配ExecutionState中的位置 返回下一个可用偏移*/
+		size_t layout(size_t offset) {
+			return opm.layout(offset);
+		}
+		/*绑定完成并layout之后 输入端口缓存上游输出端口的位置*/
+		void resolve() {
+			ipm.resolve();
+		}
+		/*把lane 0的输出值复制到整个batch*/
+		void broadcast(ExecutionState* state) {
+			opm.broadcast(state);
+		}
+		/*输入端口的绑定情况 与signature一起判断两个节点是否等价*/
+		std::string describeBindings() {
+			return ipm.describeBindings();
+		}
+		InputPortBase* getInputPort(std::string port_name) {
+			return ipm.getPort(port_name);
+		}
+		OutputPortBase* getOutputPort(std::string port_name) {
+			return opm.getPort(port_name);
+		}
+		/*把所有接在from上的输入改接到to的同名输出端口 undo不为NULL时记录原先的绑定*/
+		void replaceUpstream(Node* from, Node* to, PortBindings* undo = NULL) {
+			ipm.rebind(from->opm, to->opm, undo);
+			dependency_set.erase(from);
+			dependency_set.insert(to);
+			from->binded_set.erase(this);
+			to->binded_set.insert(this);
+		}
+		/*撤销replaceUpstream 原本就接在to上的输入保留对to的依赖*/
+		void restoreUpstream(Node* from, Node* to, const PortBindings& undo) {
+			for (int i = 0; i < undo.size(); ++i)
+				undo[i].first->bind(undo[i].second);
+			dependency_set.insert(from);
+			from->binded_set.insert(this);
+			if (!ipm.bindsTo(to->opm)) {
+				dependency_set.erase(to);
+				to->binded_set.erase(this);
+			}
+		}
 	};
 
 	class Node_Output : public Node {
+	private:
+		InputPort<Vec4f>* in_port;
 	public:
 		int width;
 		int height;
-		Color c; /*表示最后的输出结果*/
-		Node_Output() {}
+		Texture* target; /*最后的输出结果直接写入target*/
+		PixelType format; /*target的通道格式*/
+		Node_Output() : target(NULL), format(PIXEL_8U) {}
 		virtual void setAttributes(vector<std::string>ss) {
 			float w, h;
 			sscanf_s(ss[0].c_str(), "%f", &w);
@@ -73,50 +180,248 @@ namespace PhotoGraph {
 
 
 		virtual void definePorts() {
-			defineInputPort<Vec4f>("In");
+			in_port = defineInputPort<Vec4f>("In");
 		}
 		virtual void work(RuntimeInformation rinfo) {
-			Vec4f in = getInput<Vec4f>("In");
-			c = Color(in.r, in.g, in.b, in.a);
+			Vec4f in = getInput<Vec4f>(rinfo, in_port);
+			if (target->getPixelType() != PIXEL_8U) {
+				float v[4] = { in.r, in.g, in.b, in.a };
+				target->setFloat(rinfo.screenPosition.x, rinfo.screenPosition.y, v);
+				return;
+			}
+			Color c = Color(in.r, in.g, in.b, in.a);
+			target->set(rinfo.screenPosition.x, rinfo.screenPosition.y, c);
+		}
+		/*浮点target保留原值 不截断*/
+		static void kernel(Lanes<Vec4f>& in, Texture* target, const BatchInformation& binfo) {
+			if (target->getPixelType() != PIXEL_8U) {
+				for (int i = 0; i < binfo.count; ++i) {
+					float v[4] = { in.r[i], in.g[i], in.b[i], in.a[i] };
+					target->setFloat(binfo.x(i), binfo.y, v);
+				}
+				return;
+			}
+			for (int i = 0; i < binfo.count; ++i) {
+				Color c = Color(in.r[i], in.g[i], in.b[i], in.a[i]);
+				target->set(binfo.x(i), binfo.y, c);
+			}
+		}
+		virtual void workBatch(const BatchInformation& binfo) {
+			kernel(getLanes(binfo, in_port), target, binfo);
+		}
+		virtual bool lower(Instruction& ins) {
+			ins.op = OP_OUTPUT;
+			ins.src[0] = in_port->getSlot();
+			return true;
 		}
 	};
 
+	/*中间纹理 作为一个Stage的输出渲染成Texture 供之后Stage中的邻域节点采样*/
+	class Node_RenderTexture : public Node_Output {
+	private:
+		OutputPort<Texture*>* tex_port;
+	public:
+		bool sized; /*指定了尺寸 否则与最终输出相同*/
+		Node_RenderTexture() : sized(false) {
+			width = height = 0;
+		}
+		/*属性为可选的宽 高 以及可选的格式 8u(默认) fp16 fp32
+		  多个Stage之间传递的中间结果用fp16可以避免量化 内存只有fp32的一半*/
+		virtual void setAttributes(vector<std::string>ss) {
+			format = PIXEL_8U;
+			if (!ss.empty() && ss.back() == "fp16") format = PIXEL_16F;
+			if (!ss.empty() && ss.back() == "fp32") format = PIXEL_32F;
+			if (!ss.empty() && (ss.back() == "8u" || ss.back() == "fp16" || ss.back() == "fp32")) ss.pop_back();
+			sized = ss.size() >= 2;
+			if (sized) Node_Output::setAttributes(ss);
+		}
+		virtual void definePorts() {
+			Node_Output::definePorts();
+			tex_port = defineOutputPort<Texture*>("Tex");
+		}
+		/*渲染完成后 在下游Stage的ExecutionState中填入target*/
+		void publish(ExecutionState* state) {
+			Lanes<Texture*>& lanes = tex_port->getLanes(state);
+			for (int i = 0; i < BATCH_SIZE; ++i)
+				lanes.lane[i] = target;
+		}
+	};
 	class Node_Texture : public Node {
+	private:
+		OutputPort<Texture*>* tex_port;
 	public:
 		Texture* tex;
-		Node_Texture() {}
+		std::shared_ptr<Texture> source; /*从TextureCache取得 tex默认指向它 也可以被直接替换*/
+		Texture* view; /*实际被采样的纹理 tex本身或它按布局 apron和border复制的副本*/
+	private:
+		Layout layout_; /*下游有大半径的邻域采样节点时为BLOCKED 有按通道处理的节点时为PLANAR*/
+		int apron_; /*下游邻域采样的最大半径*/
+		BorderPolicy border_;
+		std::shared_ptr<Texture> copy_;
+		Texture* copy_from_;
+		std::string path_;
+		int min_width_, min_height_; /*下游只做逐点采样时解码所需的最小尺寸 为0时按原尺寸解码*/
+		int reduction_;
+		bool resolved_; /*已经compile过 min_width_和min_height_有效*/
+	public:
+		Node_Texture() : tex(NULL), view(NULL), layout_(LINEAR), apron_(0), border_(EDGE_CONSTANT), copy_from_(NULL), min_width_(0), min_height_(0), reduction_(1), resolved_(false) {}
+		/*属性为路径和可选的边缘处理方式 constant(默认 图像外为0) clamp mirror wrap
+		  第一次compile之前只记录路径 由setResolution按所需尺寸解码 之后修改路径时按已知尺寸立即加载*/
 		virtual void setAttributes(std::vector<std::string> ss) {
-			tex = new Texture (ss[0]);
-
+			path_ = ss[0];
+			source.reset();
+			tex = view = NULL;
+			if (resolved_) {
+				reduction_ = reductionFor(path_);
+				source = TextureCache::global().load(path_, reduction_);
+				tex = view = source.get();
+			}
+			border_ = EDGE_CONSTANT;
+			if (ss.size() > 1 && ss[1] == "clamp") border_ = EDGE_CLAMP;
+			if (ss.size() > 1 && ss[1] == "mirror") border_ = EDGE_MIRROR;
+			if (ss.size() > 1 && ss[1] == "wrap") border_ = EDGE_WRAP;
+			invalidateView();
+		}
+		inline BorderPolicy getBorder() { return border_; }
+		/*由Pass在compile时根据下游节点决定*/
+		void setSampling(Layout layout, int apron) {
+			layout_ = layout;
+			apron_ = apron;
+			invalidateView();
+		}
+		/*由Pass在compile时根据输出尺寸决定 width为0表示下游需要原始分辨率的像素
+		  尚未加载或倍数改变时从TextureCache加载 tex已被替换时只记录尺寸*/
+		void setResolution(int width, int height) {
+			min_width_ = width;
+			min_height_ = height;
+			resolved_ = true;
+			int reduction = reductionFor(path_);
+			if (path_.empty() || tex != source.get()) return;
+			if (source && reduction == reduction_) return;
+			reduction_ = reduction;
+			source = TextureCache::global().load(path_, reduction_);
+			tex = view = source.get();
+			invalidateView();
+		}
+		/*按当前所需尺寸解码path时可用的缩小倍数 BatchRunner对每张输入调用*/
+		inline int reductionFor(const std::string& path) {
+			return min_width_ > 0 ? Texture::reductionFor(path, min_width_, min_height_) : 1;
+		}
+		inline int getReduction() { return reduction_; }
+		inline int getMinWidth() { return min_width_; }
+		inline int getMinHeight() { return min_height_; }
+		/*丢弃本节点按布局复制的副本 tex本身可能与其他Pass共享 不在这里修改它的缓存状态*/
+		void invalidateView() {
+			copy_.reset();
+			copy_from_ = NULL;
+		}
+		/*渲染前在单线程中调用 窗口纹理保持原样*/
+		void refreshView() {
+			bool plain = layout_ == LINEAR && apron_ == 0 && border_ == EDGE_CONSTANT;
+			if (plain || tex == NULL || tex->isWindowed()) {
+				view = tex;
+				return;
+			}
+			if (copy_from_ != tex) {
+				copy_.reset(tex->copyWith(layout_, apron_, border_));
+				copy_from_ = tex;
+			}
+			view = copy_.get();
 		}
 
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineOutputPort<Texture*>("Tex");
+			tex_port = defineOutputPort<Texture*>("Tex");
 		}
 		virtual void work(RuntimeInformation rinfo) {
-			setOutput<Texture*>("Tex", tex);
+			setOutput<Texture*>(rinfo, tex_port, view);
+		}
+		static void kernel(Texture* tex, Lanes<Texture*>& out, int count) {
+			for (int i = 0; i < count; ++i)
+				out.lane[i] = tex;
+		}
+		virtual void workBatch(const BatchInformation& binfo) {
+			kernel(view, getLanes(binfo, tex_port), binfo.count);
+		}
+		/*tex可能在setAttributes之后被替换 被替换时以实际的Texture区分 否则以路径区分(compile之前尚未加载)*/
+		virtual std::string signature() {
+			std::ostringstream sig;
+			sig << typeid(*this).name() << "|" << border_ << "|";
+			if (tex != source.get()) sig << (void*)tex;
+			else sig << path_;
+			return sig.str();
+		}
+		virtual bool lower(Instruction& ins) {
+			ins.op = OP_TEXTURE;
+			ins.dst = tex_port->getSlot();
+			return true;
 		}
 	};
 
 	class Node_Sample_Texture : public Node {
+	private:
+		InputPort<Texture*>* tex_port;
+		InputPort<Vec2f>* uv_port;
+		OutputPort<Vec4f>* out_port;
+		SampleMode mode;
 	public:
-		Node_Sample_Texture() {}
+		Node_Sample_Texture() : mode(SAMPLE_NEAREST) {}
+		/*属性为采样方式 nearest(默认) bilinear trilinear*/
+		virtual void setAttributes(vector<string> ss) {
+			mode = SAMPLE_NEAREST;
+			if (ss.size() > 0 && ss[0] == "bilinear") mode = SAMPLE_BILINEAR;
+			if (ss.size() > 0 && ss[0] == "trilinear") mode = SAMPLE_TRILINEAR;
+		}
+		inline SampleMode getMode() { return mode; }
+		virtual bool isVarying() { return !isBinded(uv_port); }
+		virtual int sampleRadius() { return isBinded(uv_port) ? -1 : mode == SAMPLE_NEAREST ? 0 : 1; }
 		virtual void definePorts() {
-			defineInputPort<Texture*>("Tex");
-			defineInputPort<Vec2f>("UV");
-			defineOutputPort<Vec4f>("Out");
+			tex_port = defineInputPort<Texture*>("Tex");
+			uv_port = defineInputPort<Vec2f>("UV");
+			out_port = defineOutputPort<Vec4f>("Out");
 		}
 		virtual void work(RuntimeInformation rinfo) {
 			Vec2f uv;
-			if (!isBinded("UV")) {
+			if (!isBinded(uv_port)) {
 				uv = rinfo.uv0;
 			}
 			else {
-				uv = getInput<Vec2f>("UV");
+				uv = getInput<Vec2f>(rinfo, uv_port);
 			}
-			Texture* tex = getInput<Texture*>("Tex");
-			Color c = tex->get(uv.u * tex->getPixelWidth(), uv.v * tex->getPixelHeight());
-			setOutput<Vec4f>("Out", Vec4f(c.r, c.g, c.b, c.a));
+			Texture* tex = getInput<Texture*>(rinfo, tex_port);
+			float c[4];
+			tex->sample(uv.u, uv.v, mode, 0, c);
+			setOutput<Vec4f>(rinfo, out_port, Vec4f(c[0], c[1], c[2], c[3]));
+		}
+		/*纹理相对输出的缩小倍数 以2为底*/
+		static inline float levelOfDetail(Texture* tex, const BatchInformation& binfo) {
+			float scale = std::max((float)tex->getPixelWidth() / binfo.width, (float)tex->getPixelHeight() / binfo.height);
+			return scale > 1 ? log2f(scale) : 0;
+		}
+		/*uv为NULL时使用uv0*/
+		static void kernel(Lanes<Texture*>& tex, Lanes<Vec2f>* uv, Lanes<Vec4f>& out, const BatchInformation& binfo, SampleMode mode = SAMPLE_NEAREST) {
+			for (int i = 0; i < binfo.count; ++i) {
+				Vec2f p = uv != NULL ? uv->get(i) : binfo.uv0(i);
+				if (mode == SAMPLE_NEAREST && tex.lane[i]->getPixelType() == PIXEL_8U) {
+					Color c = tex.lane[i]->get(p.u * tex.lane[i]->getPixelWidth(), p.v * tex.lane[i]->getPixelHeight());
+					out.r[i] = c.r; out.g[i] = c.g; out.b[i] = c.b; out.a[i] = c.a;
+					continue;
+				}
+				float c[4];
+				tex.lane[i]->sample(p.u, p.v, mode, mode == SAMPLE_NEAREST ? 0 : levelOfDetail(tex.lane[i], binfo), c);
+				out.r[i] = c[0]; out.g[i] = c[1]; out.b[i] = c[2]; out.a[i] = c[3];
+			}
+		}
+		virtual void workBatch(const BatchInformation& binfo) {
+			kernel(getLanes(binfo, tex_port), isBinded(uv_port) ? &getLanes(binfo, uv_port) : NULL, getLanes(binfo, out_port), binfo, mode);
+		}
+		virtual bool lower(Instruction& ins) {
+			ins.op = OP_SAMPLE;
+			ins.src[0] = tex_port->getSlot();
+			ins.src[1] = uv_port->getSlot();
+			ins.dst = out_port->getSlot();
+			ins.imm[0] = (float)mode;
+			return true;
 		}
 	};
 
@@ -137,25 +442,56 @@ namespace PhotoGraph {
 
 	/*RGB翻转*/
 	class Node_Inverse : public Node {
+	private:
+		InputPort<Vec4f>* in_port;
+		OutputPort<Vec4f>* out_port;
 	public:
 		Node_Inverse() {}
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<Vec4f>("In");
-			defineOutputPort<Vec4f>("Out");
+			in_port = defineInputPort<Vec4f>("In");
+			out_port = defineOutputPort<Vec4f>("Out");
 		}
 
+		/*逐像素运算 供融合内核按模板参数内联*/
+		struct Op {
+			inline Vec4f operator () (Vec4f v) const {
+				v.r = 255 - v.r;
+				v.g = 255 - v.g;
+				v.b = 255 - v.b;
+				return v;
+			}
+		};
+		inline Op op() { return Op(); }
+
 		virtual void work(RuntimeInformation rinfo) {
-			Vec4f v = getInput<Vec4f>("In");
-			v.r = 255 - v.r;
-			v.g = 255 - v.g;
-			v.b = 255 - v.b;
-			setOutput<Vec4f>("Out", v);
+			setOutput<Vec4f>(rinfo, out_port, Op()(getInput<Vec4f>(rinfo, in_port)));
+		}
+		static void kernel(Lanes<Vec4f>& in, Lanes<Vec4f>& out, int count) {
+			for (int i = 0; i < count; ++i) {
+				out.r[i] = 255 - in.r[i];
+				out.g[i] = 255 - in.g[i];
+				out.b[i] = 255 - in.b[i];
+				out.a[i] = in.a[i];
+			}
+		}
+		virtual void workBatch(const BatchInformation& binfo) {
+			kernel(getLanes(binfo, in_port), getLanes(binfo, out_port), binfo.count);
+		}
+		virtual bool lower(Instruction& ins) {
+			ins.op = OP_INVERSE;
+			ins.src[0] = in_port->getSlot();
+			ins.dst = out_port->getSlot();
+			return true;
 		}
 	};
 
 	/*对比度调整  需要threshold*/
 	class Node_AdjustContrast : public Node {
 	private:
+		InputPort<Vec4f>* in_port;
+		InputPort<Texture*>* tex_port;
+		OutputPort<Vec4f>* out_port;
 		float contrast=0.05;  //+-0.1
 	public:
 		Node_AdjustContrast() {}
@@ -164,14 +500,23 @@ namespace PhotoGraph {
 			contrast = stof(ss[0]);
 		}
 
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<Vec4f>("In");
-			defineInputPort<Texture*>("TexIn");
-			defineOutputPort<Vec4f>("Out");
+			in_port = defineInputPort<Vec4f>("In");
+			tex_port = defineInputPort<Texture*>("TexIn");
+			out_port = defineOutputPort<Vec4f>("Out");
+		}
+		/*在进入多线程渲染之前求出平均值 避免第一个像素所在的线程独自计算而其他线程等待*/
+		void prefetch(ExecutionState* uniforms) {
+			RuntimeInformation rinfo;
+			rinfo.state = uniforms;
+			rinfo.lane = 0;
+			Texture* Tex = getInput<Texture*>(rinfo, tex_port);
+			if (Tex != NULL) Tex->getAverageRGB();
 		}
 		virtual void work(RuntimeInformation rinfo) {
-			Vec4f inputColor = getInput<Vec4f>("In");
-			Texture* Tex = getInput<Texture*>("TexIn");
+			Vec4f inputColor = getInput<Vec4f>(rinfo, in_port);
+			Texture* Tex = getInput<Texture*>(rinfo, tex_port);
 
 
 
@@ -188,42 +533,84 @@ namespace PhotoGraph {
 			else {
 				adjustedColor = inputColor;
 			}
-			setOutput<Vec4f>("Out", adjustedColor);
+			setOutput<Vec4f>(rinfo, out_port, adjustedColor);
 		}
 	};
 
 	/*饱和度 需要threshold*/
 	class Node_Saturation : public Node {
 	private:
+		InputPort<Vec4f>* in_port;
+		OutputPort<Vec4f>* out_port;
 		float saturation=1.05;   //0~1变灰  1+过饱和
 	public:
 		Node_Saturation() {}
 		virtual void setAttributes(vector<string>ss) {
 			saturation = stof(ss[0]);
 		}
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<Vec4f>("In");
-			defineOutputPort<Vec4f>("Out");
+			in_port = defineInputPort<Vec4f>("In");
+			out_port = defineOutputPort<Vec4f>("Out");
+		}
+		/*逐像素运算 供融合内核按模板参数内联*/
+		struct Op {
+			float saturation;
+			inline Vec4f operator () (const Vec4f& inputColor) const {
+				float r, g, b;
+				if (saturation < 1) {
+					float gray = (inputColor.r + inputColor.g + inputColor.b) / 3;
+					r = lerp(gray, inputColor.r, saturation);
+					g = lerp(gray, inputColor.g, saturation);
+					b = lerp(gray, inputColor.b, saturation);
+				}
+				else {
+					r = inputColor.r * saturation;
+					g = inputColor.g * saturation;
+					b = inputColor.b * saturation;
+				}
+				return Vec4f(r, g, b, inputColor.a);
+			}
+		};
+		inline Op op() {
+			Op o;
+			o.saturation = saturation;
+			return o;
 		}
 		virtual void work(RuntimeInformation rinfo) {
-			Vec4f inputColor = getInput<Vec4f>("In");
-			float r, g, b;
-			if (saturation < 1) {
-				float gray = (inputColor.r + inputColor.g + inputColor.b) / 3;
-				 r = lerp(gray, inputColor.r, saturation);
-				 g = lerp(gray, inputColor.g, saturation);
-				 b = lerp(gray, inputColor.b, saturation);
+			setOutput<Vec4f>(rinfo, out_port, op()(getInput<Vec4f>(rinfo, in_port)));
+		}
+		static void kernel(Lanes<Vec4f>& in, Lanes<Vec4f>& out, int count, float s) {
+			if (s < 1) {
+				for (int i = 0; i < count; ++i) {
+					float gray = (in.r[i] + in.g[i] + in.b[i]) / 3;
+					out.r[i] = lerp(gray, in.r[i], s);
+					out.g[i] = lerp(gray, in.g[i], s);
+					out.b[i] = lerp(gray, in.b[i], s);
+					out.a[i] = in.a[i];
+				}
 			}
 			else {
-				 r = inputColor.r * saturation;
-				 g = inputColor.g * saturation;
-				 b = inputColor.b * saturation;
+				for (int i = 0; i < count; ++i) {
+					out.r[i] = in.r[i] * s;
+					out.g[i] = in.g[i] * s;
+					out.b[i] = in.b[i] * s;
+					out.a[i] = in.a[i];
+				}
 			}
-
-			setOutput<Vec4f>("Out", Vec4f(r, g, b, inputColor.a));
+		}
+		virtual void workBatch(const BatchInformation& binfo) {
+			kernel(getLanes(binfo, in_port), getLanes(binfo, out_port), binfo.count, saturation);
+		}
+		virtual bool lower(Instruction& ins) {
+			ins.op = OP_SATURATION;
+			ins.src[0] = in_port->getSlot();
+			ins.dst = out_port->getSlot();
+			ins.imm[0] = saturation;
+			return true;
 		}
 		// 简单线性插值
-		float lerp(float a, float b, float t) {
+		static float lerp(float a, float b, float t) {
 			return a * (1 - t) + b * t;
 		}
 	};
@@ -232,35 +619,71 @@ namespace PhotoGraph {
 
 	/*RGB转灰度*/
 	class Node_RGB2Grayscale : public Node {
+	private:
+		InputPort<Vec4f>* in_port;
+		OutputPort<float>* out_port;
 	public:
 		Node_RGB2Grayscale() {}
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<Vec4f>("In");
-			defineOutputPort<float>("Out");
+			in_port = defineInputPort<Vec4f>("In");
+			out_port = defineOutputPort<float>("Out");
 		}
 		virtual void work(RuntimeInformation rinfo) {
-			Vec4f v = getInput<Vec4f>("In");
+			Vec4f v = getInput<Vec4f>(rinfo, in_port);
 			float t = 0.299 * v.r + 0.587 * v.g + 0.114 * v.b;
 			/*经验公式*/
-			setOutput<float>("Out", t);
+			setOutput<float>(rinfo, out_port, t);
+		}
+		static void kernel(Lanes<Vec4f>& in, Lanes<float>& out, int count) {
+			for (int i = 0; i < count; ++i)
+				out.lane[i] = 0.299 * in.r[i] + 0.587 * in.g[i] + 0.114 * in.b[i];
+		}
+		virtual void workBatch(const BatchInformation& binfo) {
+			kernel(getLanes(binfo, in_port), getLanes(binfo, out_port), binfo.count);
+		}
+		virtual bool lower(Instruction& ins) {
+			ins.op = OP_GRAY;
+			ins.src[0] = in_port->getSlot();
+			ins.dst = out_port->getSlot();
+			return true;
 		}
 	};
 
 
 	/*灰度转RGB 用于输出*/
 	class Node_Gray2RGB : public Node {
+	private:
+		InputPort<float>* in_port;
+		OutputPort<Vec4f>* out_port;
 	public:
 		Node_Gray2RGB() {}
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<float>("In");
-			defineOutputPort<Vec4f>("Out");
+			in_port = defineInputPort<float>("In");
+			out_port = defineOutputPort<Vec4f>("Out");
 		}
 		virtual void work(RuntimeInformation rinfo) {
-			float t = getInput<float>("In");
+			float t = getInput<float>(rinfo, in_port);
 			Vec4f v;
 			v.r = v.g = v.b = t;
 			v.a = 100;
-			setOutput<Vec4f>("Out", v);
+			setOutput<Vec4f>(rinfo, out_port, v);
+		}
+		static void kernel(Lanes<float>& in, Lanes<Vec4f>& out, int count) {
+			for (int i = 0; i < count; ++i) {
+				out.r[i] = out.g[i] = out.b[i] = in.lane[i];
+				out.a[i] = 100;
+			}
+		}
+		virtual void workBatch(const BatchInformation& binfo) {
+			kernel(getLanes(binfo, in_port), getLanes(binfo, out_port), binfo.count);
+		}
+		virtual bool lower(Instruction& ins) {
+			ins.op = OP_GRAY2RGB;
+			ins.src[0] = in_port->getSlot();
+			ins.dst = out_port->getSlot();
+			return true;
 		}
 	};
 
@@ -268,6 +691,8 @@ namespace PhotoGraph {
 	/*灰度图二值化*/
 	class Node_Binarization : public Node {
 	private:
+		InputPort<float>* in_port;
+		OutputPort<float>* out_port;
 		float threshold=127;
 	public:
 		Node_Binarization() {}
@@ -277,21 +702,38 @@ namespace PhotoGraph {
 		}
 
 
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<float>("In");
-			defineOutputPort<float>("Out");
+			in_port = defineInputPort<float>("In");
+			out_port = defineOutputPort<float>("Out");
 		}
 		virtual void work(RuntimeInformation rinfo) {
-			float v = getInput<float>("In");
+			float v = getInput<float>(rinfo, in_port);
 			if (v > threshold)  v = 255.0;
 			else v = 0.0;
-			setOutput<float>("Out", v);
+			setOutput<float>(rinfo, out_port, v);
+		}
+		static void kernel(Lanes<float>& in, Lanes<float>& out, int count, float threshold) {
+			for (int i = 0; i < count; ++i)
+				out.lane[i] = in.lane[i] > threshold ? 255.0f : 0.0f;
+		}
+		virtual void workBatch(const BatchInformation& binfo) {
+			kernel(getLanes(binfo, in_port), getLanes(binfo, out_port), binfo.count, threshold);
+		}
+		virtual bool lower(Instruction& ins) {
+			ins.op = OP_BINARIZE;
+			ins.src[0] = in_port->getSlot();
+			ins.dst = out_port->getSlot();
+			ins.imm[0] = threshold;
+			return true;
 		}
 	};
 
 	/*平移*/
 	class Node_Move : public Node {
 		private:
+		InputPort<Vec2f>* uv_port;
+		OutputPort<Vec2f>* out_port;
 		float X_Offset = 0.5;
 		float Y_Offset = 0.5;
 		//默认 前端可改
@@ -303,35 +745,61 @@ namespace PhotoGraph {
 			sscanf_s(ss[1].c_str(), "%f", &Y_Offset);//等价 string to float
 		}
 
+		virtual bool isVarying() { return !isBinded(uv_port); }
 		virtual void definePorts() {
-			defineInputPort<Vec2f>("UV");
-			defineOutputPort<Vec2f>("Out");
+			uv_port = defineInputPort<Vec2f>("UV");
+			out_port = defineOutputPort<Vec2f>("Out");
 		}
 		virtual void work(RuntimeInformation rinfo) {
 			Vec2f input;
-			if (!isBinded("UV")) {
+			if (!isBinded(uv_port)) {
 				input = rinfo.uv0;
 			}
 			else {
-				input = getInput<Vec2f>("UV");
+				input = getInput<Vec2f>(rinfo, uv_port);
 			}
 			Vec2f output; 
 			output.u= input.u - X_Offset;
 			output.v= input.v - Y_Offset;
-			setOutput<Vec2f>("Out", output);
+			setOutput<Vec2f>(rinfo, out_port, output);
+		}
+		/*uv为NULL时使用uv0*/
+		static void kernel(Lanes<Vec2f>* uv, Lanes<Vec2f>& out, const BatchInformation& binfo, float x_offset, float y_offset) {
+			for (int i = 0; i < binfo.count; ++i) {
+				Vec2f input = uv != NULL ? uv->get(i) : binfo.uv0(i);
+				out.u[i] = input.u - x_offset;
+				out.v[i] = input.v - y_offset;
+			}
+		}
+		virtual void workBatch(const BatchInformation& binfo) {
+			kernel(isBinded(uv_port) ? &getLanes(binfo, uv_port) : NULL, getLanes(binfo, out_port), binfo, X_Offset, Y_Offset);
+		}
+		virtual bool lower(Instruction& ins) {
+			ins.op = OP_MOVE;
+			ins.src[0] = uv_port->getSlot();
+			ins.dst = out_port->getSlot();
+			ins.imm[0] = X_Offset;
+			ins.imm[1] = Y_Offset;
+			return true;
 		}
 	};
 
 
 	class Node_Matrix3 : public Node {
 	private:
+		OutputPort<Matrix3x3>* out_port;
 		float f1 = 0;   float f2 = -2;   float f3 = 0;
 		float f4 = 0;   float f5 = 4;   float f6 = 0;
 		float f7 = 0;   float f8 = -2;   float f9 = 0;
 		Matrix3x3 operat;
 
 	public:
-		Node_Matrix3() {}
+		Node_Matrix3() {
+			initialM(f1, f2, f3,
+				f4, f5, f6,
+				f7, f8, f9
+			);
+		}
 		virtual void setAttributes(vector<string>ss) {
 			//string转float
 			f1 = stof(ss[0]);
@@ -343,20 +811,22 @@ namespace PhotoGraph {
 			f7 = stof(ss[6]);
 			f8 = stof(ss[7]);
 			f9 = stof(ss[8]);
+			initialM(f1, f2, f3,
+				f4, f5, f6,
+				f7, f8, f9
+			);
 		}
 
 
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineOutputPort<Matrix3x3>("Out");
+			out_port = defineOutputPort<Matrix3x3>("Out");
 		}
 
 		virtual void work(RuntimeInformation rinfo) {
-			initialM(f1, f2, f3,
-				f4, f5, f6,
-				f7, f8, f9
-			);
-			setOutput <Matrix3x3 >("Out", operat);
+			setOutput<Matrix3x3 >(rinfo, out_port, operat);
 		}
+		inline Matrix3x3 getMatrix() { return operat; }
 
 		virtual void initialM(float f1, float f2, float f3, float f4, float f5, float f6, float f7, float f8, float f9) {
 			operat.raw[0][0] = f1; operat.raw[0][1] = f2; operat.raw[0][2] = f3;
@@ -372,39 +842,41 @@ namespace PhotoGraph {
 
 	/*矩阵乘算 不传UV  权值为0  提取值方向的花纹   权值+ 高亮曝光*/
 	class Node_Matrix3_Sample : public Node {
+	private:
+		InputPort<Texture*>* tex_port;
+		InputPort<Vec2f>* uv_port;
+		InputPort<Matrix3x3>* mat_port;
+		OutputPort<Vec4f>* out_port;
 
 	public:
 		Node_Matrix3_Sample() {}
+		virtual bool isVarying() { return !isBinded(uv_port); }
+		virtual int sampleRadius() { return isBinded(uv_port) ? -1 : 1; }
 		virtual void definePorts() {
-			defineInputPort<Texture*>("Tex");
-			defineInputPort<Vec2f>("UV");
-			defineInputPort<Matrix3x3>("Mat");
-			defineOutputPort<Vec4f>("Out");
+			tex_port = defineInputPort<Texture*>("Tex");
+			uv_port = defineInputPort<Vec2f>("UV");
+			mat_port = defineInputPort<Matrix3x3>("Mat");
+			out_port = defineOutputPort<Vec4f>("Out");
 		}
 		virtual void work(RuntimeInformation rinfo) {
 			Vec2f uv;
-			if (!isBinded("UV")) {
+			if (!isBinded(uv_port)) {
 				uv = rinfo.uv0;
 			}
-			else uv = getInput<Vec2f>("UV");
-			Texture* tex = getInput<Texture*>("Tex");
+			else uv = getInput<Vec2f>(rinfo, uv_port);
+			Texture* tex = getInput<Texture*>(rinfo, tex_port);
 			
 			Vec4f output;
 			
 
 			Matrix3x3 operat;
-			operat=getInput<Matrix3x3>("Mat");
-
-			std::vector<Color> colors;
+			operat=getInput<Matrix3x3>(rinfo, mat_port);
 
-			for (int i = -1; i <= 1; i++) {
-				for (int j = -1; j <= 1; j++) {
+			std::vector<Vec4f> colors;
 
-					Color c = tex->get(uv.u * tex->getPixelWidth()  +i  , uv.v * tex->getPixelHeight()+j);
-					//绝对坐标=uv*长宽
-					colors.push_back(c);
-				}
-			}
+			colors.resize(9);
+			//绝对坐标=uv*长宽
+			tex->gatherFloat(uv.u * tex->getPixelWidth(), uv.v * tex->getPixelHeight(), 1, colors.data());
 			//calculate
 			output.r = output.g = output.b = 0; output.a = 100;
 			int cnt = 0;
@@ -432,7 +904,7 @@ namespace PhotoGraph {
 	
 			output.a = colors[5].raw[3];//中心点的a
 			//printf("%f", colors[5].raw[2]); 
-			setOutput <Vec4f> ("Out", output);
+			setOutput<Vec4f>(rinfo, out_port, output);
 			
 		}
 		
@@ -442,28 +914,30 @@ namespace PhotoGraph {
 
 	/*9*9模糊*/
 	class Node_Matrix9_Avg : public Node {
+	private:
+		InputPort<Texture*>* tex_port;
+		InputPort<Vec2f>* uv_port;
+		OutputPort<Vec4f>* out_port;
 	public:
 		Node_Matrix9_Avg() {}
+		virtual bool isVarying() { return !isBinded(uv_port); }
+		virtual int sampleRadius() { return isBinded(uv_port) ? -1 : 4; }
 		virtual void definePorts() {
-			defineInputPort<Texture*>("Tex");
-			defineInputPort<Vec2f>("UV");
-			defineOutputPort<Vec4f>("Out");
+			tex_port = defineInputPort<Texture*>("Tex");
+			uv_port = defineInputPort<Vec2f>("UV");
+			out_port = defineOutputPort<Vec4f>("Out");
 		}
 		virtual void work(RuntimeInformation rinfo) {
 			Vec2f uv;
-			if (!isBinded("UV")) {
+			if (!isBinded(uv_port)) {
 				uv = rinfo.uv0;
 			}
-			else uv = getInput<Vec2f>("UV");
-			Texture* tex = getInput<Texture*>("Tex");
-			std::vector<Color> colors;
+			else uv = getInput<Vec2f>(rinfo, uv_port);
+			Texture* tex = getInput<Texture*>(rinfo, tex_port);
+			std::vector<Vec4f> colors;
 			/*colors  012  345  678*/
-			for (int i = -4; i <= 4; i++) {
-				for (int j = -4; j <= 4; j++) {
-					Color c = tex->get(uv.u * tex->getPixelWidth() + i, uv.v * tex->getPixelHeight() + j);
-					colors.push_back(c);
-				}
-			}
+			colors.resize(81);
+			tex->gatherFloat(uv.u * tex->getPixelWidth(), uv.v * tex->getPixelHeight(), 4, colors.data());
 			//calculate
 			Vec4f sum; sum.r =sum.g = sum.b = 0; sum.a = 100;
 			for (int i = 0; i < 81; i++) {
@@ -475,42 +949,52 @@ namespace PhotoGraph {
 			sum.g = sum.g / 81;
 			sum.b = sum.b / 81;
 			sum.a = colors[41].a;//中心点的a
-			setOutput <Vec4f>("Out", sum);
+			setOutput<Vec4f>(rinfo, out_port, sum);
 		}
 	};
 
 
+	/*逐通道邻域节点的batch能否直接在PLANAR纹理上按行计算
+	  要求输出像素与纹理像素一一对应 且邻域完全落在apron之内*/
+	inline bool planarBatch(Texture* tex, const BatchInformation& binfo, int radius) {
+		return tex != NULL && tex->getLayout() == PLANAR && tex->getPixelType() == PIXEL_8U && tex->getBytespp() >= RGB && !tex->isWindowed()
+			&& tex->getApron() >= radius && binfo.stride == 1 && tex->getPixelWidth() == binfo.width && tex->getPixelHeight() == binfo.height;
+	}
+
 	/*3*3  中(均)值滤波  去噪    */
 	class Node_MedianFilter : public Node {
+	private:
+		InputPort<Texture*>* tex_port;
+		InputPort<Vec2f>* uv_port;
+		OutputPort<Vec4f>* out_port;
 	public:
 		Node_MedianFilter() {}
+		virtual bool isVarying() { return !isBinded(uv_port); }
+		virtual int sampleRadius() { return isBinded(uv_port) ? -1 : 1; }
+		virtual bool prefersPlanar() { return !isBinded(uv_port); }
 		virtual void definePorts() {
-			defineInputPort<Texture*>("Tex");
-			defineInputPort<Vec2f>("UV");
-			defineOutputPort<Vec4f>("Out");
+			tex_port = defineInputPort<Texture*>("Tex");
+			uv_port = defineInputPort<Vec2f>("UV");
+			out_port = defineOutputPort<Vec4f>("Out");
 		}
 		virtual void work(RuntimeInformation rinfo) {
 			Vec2f uv;
-			if (!isBinded("UV")) {
+			if (!isBinded(uv_port)) {
 				uv = rinfo.uv0;
 			}
-			else uv = getInput<Vec2f>("UV");
-			Texture* tex = getInput<Texture*>("Tex");
+			else uv = getInput<Vec2f>(rinfo, uv_port);
+			Texture* tex = getInput<Texture*>(rinfo, tex_port);
 
 			Vec4f output;
 
-			std::vector<Color> colors;
+			std::vector<Vec4f> colors;
 
-			for (int i = -1; i <= 1; i++) {
-				for (int j = -1; j <= 1; j++) {
-					Color c = tex->get(uv.u * tex->getPixelWidth() + i, uv.v * tex->getPixelHeight() + j);
-					colors.push_back(c);
-				}
-			}
+			colors.resize(9);
+			tex->gatherFloat(uv.u * tex->getPixelWidth(), uv.v * tex->getPixelHeight(), 1, colors.data());
 			float sumR = 0.0;
 			float sumG = 0.0;
 			float sumB = 0.0;
-			for (const Color& c : colors) {
+			for (const Vec4f& c : colors) {
 				sumR += c.raw[0]; 
 				sumG += c.raw[1]; 
 				sumB += c.raw[2];
@@ -524,13 +1008,30 @@ namespace PhotoGraph {
 			output.g = avgG;
 			output.b = avgB;
 			output.a = colors[5].a;
-			setOutput<Vec4f>("Out", output);
+			setOutput<Vec4f>(rinfo, out_port, output);
+		}
+		/*每个通道16个像素一起求和 alpha与work相同取colors[5]即(x, y+1)*/
+		virtual void workBatch(const BatchInformation& binfo) {
+			Texture* tex = getLanes(binfo, tex_port).get(0);
+			if (isBinded(uv_port) || !planarBatch(tex, binfo, 1)) {
+				Node::workBatch(binfo);
+				return;
+			}
+			Lanes<Vec4f>& out = getLanes(binfo, out_port);
+			tex->reduceWindow(0, binfo.x0, binfo.y, binfo.count, 1, WINDOW_MEAN, out.r);
+			tex->reduceWindow(1, binfo.x0, binfo.y, binfo.count, 1, WINDOW_MEAN, out.g);
+			tex->reduceWindow(2, binfo.x0, binfo.y, binfo.count, 1, WINDOW_MEAN, out.b);
+			for (int i = 0; i < binfo.count; ++i)
+				out.a[i] = tex->get(binfo.x0 + i, binfo.y + 1).a;
 		}
 	};
 
 	/*随机椒盐噪声 */
 	class Node_SaltAndPepperNoise : public Node {
 	private:
+		InputPort<Vec4f>* in_port;
+		InputPort<Vec2f>* uv_port;
+		OutputPort<Vec4f>* out_port;
 		float p = 0.05;//噪声概率
 	public:
 		Node_SaltAndPepperNoise() {}
@@ -540,10 +1041,11 @@ namespace PhotoGraph {
 		}
 
 
+		virtual bool isDeterministic() { return false; }
 		virtual void definePorts() {
-			defineInputPort<Vec4f>("In");
-			defineInputPort<Vec2f>("UV");
-			defineOutputPort<Vec4f>("Out");
+			in_port = defineInputPort<Vec4f>("In");
+			uv_port = defineInputPort<Vec2f>("UV");
+			out_port = defineOutputPort<Vec4f>("Out");
 			
 		}
 	
@@ -569,21 +1071,21 @@ namespace PhotoGraph {
 
 		virtual void work(RuntimeInformation rinfo) {
 			Vec2f uv;
-			if (!isBinded("UV")) {
+			if (!isBinded(uv_port)) {
 				uv = rinfo.uv0;
 			}
 			else {
-				uv = getInput<Vec2f>("UV");
+				uv = getInput<Vec2f>(rinfo, uv_port);
 			}
 
-			Vec4f input=getInput<Vec4f>("In");
+			Vec4f input=getInput<Vec4f>(rinfo, in_port);
 			Vec4f output;
 
 			output.r=input.r; output.g = input.g; output.b = input.b;
 		
 			addSaltAndPepperNoise(output, p, p); // 加 p概率的椒盐噪声
 			output.a = 100;
-			setOutput<Vec4f>("Out", output);
+			setOutput<Vec4f>(rinfo, out_port, output);
 		}
 
 	};
@@ -651,6 +1153,9 @@ namespace PhotoGraph {
 	/*均匀噪声  柏林噪声*/
 	class Node_PerlinNoise : public Node {
 	private:
+		InputPort<Vec2f>* uv_port;
+		InputPort<Texture*>* tex_port;
+		OutputPort<Vec4f>* out_port;
 		float scale = 1.0;// 噪声尺度
 	public:
 		Node_PerlinNoise(vector<string> ss) {}
@@ -658,23 +1163,25 @@ namespace PhotoGraph {
 			sscanf_s(ss[0].c_str(), "%f", scale);
 		}
 
+		virtual bool isDeterministic() { return false; }
+		virtual int sampleRadius() { return isBinded(uv_port) ? -1 : 0; }
 		virtual void definePorts() {
-			defineInputPort<Vec2f>("UV");
-			defineInputPort<Texture*>("Tex");
-			defineOutputPort<Vec4f>("Out");
+			uv_port = defineInputPort<Vec2f>("UV");
+			tex_port = defineInputPort<Texture*>("Tex");
+			out_port = defineOutputPort<Vec4f>("Out");
 
 		}
 
 		virtual void work(RuntimeInformation rinfo) {
 			Vec2f uv;
-			if (!isBinded("UV")) {
+			if (!isBinded(uv_port)) {
 				uv = rinfo.uv0;
 			}
 			else {
-				uv = getInput<Vec2f>("UV");
+				uv = getInput<Vec2f>(rinfo, uv_port);
 			}
 
-			Texture* tex = getInput<Texture*>("Tex");
+			Texture* tex = getInput<Texture*>(rinfo, tex_port);
 			Color c = tex->get(uv.u * tex->getPixelWidth(), uv.v * tex->getPixelHeight());
 			Vec4f output;
 
@@ -684,7 +1191,7 @@ namespace PhotoGraph {
 			//debug
 			output.r = noiseValue;
 			output.a =c.raw[3];
-			setOutput<Vec4f>("Out", output);
+			setOutput<Vec4f>(rinfo, out_port, output);
 		}
 
 	};
@@ -696,49 +1203,52 @@ namespace PhotoGraph {
 
 	/* 最值膨胀（白而糊）  彩色版*/
 	class Node_Dilation : public Node {
+	private:
+		InputPort<Texture*>* tex_port;
+		InputPort<Vec2f>* uv_port;
+		OutputPort<Vec4f>* out_port;
 	
 	private:
 		int core=3; //2*core+1即卷积核边长
 	public:
 		Node_Dilation() {}
 		virtual void setAttributes(vector<string>ss) {
-			sscanf_s(ss[0].c_str(), "%f", core);
+			sscanf_s(ss[0].c_str(), "%d", &core);
 		}
+		virtual bool isVarying() { return !isBinded(uv_port); }
+		virtual int sampleRadius() { return isBinded(uv_port) ? -1 : core; }
+		virtual bool prefersPlanar() { return !isBinded(uv_port); }
 		virtual void definePorts() {
-			defineInputPort<Texture*>("Tex");
-			defineInputPort<Vec2f>("UV");
-			defineOutputPort<Vec4f>("Out");
+			tex_port = defineInputPort<Texture*>("Tex");
+			uv_port = defineInputPort<Vec2f>("UV");
+			out_port = defineOutputPort<Vec4f>("Out");
 		}
 
 		virtual void work(RuntimeInformation rinfo) {
 			Vec2f uv;
-			if (!isBinded("UV")) {
+			if (!isBinded(uv_port)) {
 				uv = rinfo.uv0;
 			}
 			else {
-				uv = getInput<Vec2f>("UV");
+				uv = getInput<Vec2f>(rinfo, uv_port);
 			}
-			Texture* tex = getInput<Texture*>("Tex");
+			Texture* tex = getInput<Texture*>(rinfo, tex_port);
 
 			Vec4f output;
-			std::vector<Color> colors;
+			std::vector<Vec4f> colors;
 
 			// 3x3
-			for (int i = -core; i <= core; i++) {
-				for (int j = -core; j <= core; j++) {
-					Color c = tex->get(uv.u * tex->getPixelWidth() + i, uv.v * tex->getPixelHeight() + j);
-					colors.push_back(c);
-				}
-			}
+			colors.resize((2 * core + 1) * (2 * core + 1));
+			tex->gatherFloat(uv.u * tex->getPixelWidth(), uv.v * tex->getPixelHeight(), core, colors.data());
 
 			// Find RGB max color 
-			auto maxColorR = std::max_element(colors.begin(), colors.end(), [](const Color& a, const Color& b) {
+			auto maxColorR = std::max_element(colors.begin(), colors.end(), [](const Vec4f& a, const Vec4f& b) {
 				return a.r < b.r;
 				});
-			auto maxColorG = std::max_element(colors.begin(), colors.end(), [](const Color& a, const Color& b) {
+			auto maxColorG = std::max_element(colors.begin(), colors.end(), [](const Vec4f& a, const Vec4f& b) {
 				return a.g < b.g;
 				});
-			auto maxColorB = std::max_element(colors.begin(), colors.end(), [](const Color& a, const Color& b) {
+			auto maxColorB = std::max_element(colors.begin(), colors.end(), [](const Vec4f& a, const Vec4f& b) {
 				return a.b < b.b;
 				});
 
@@ -747,55 +1257,71 @@ namespace PhotoGraph {
 			output.b = maxColorB->b;
 			output.a = colors[2*core*core+2*core].a;//卷积核中心点
 
-			setOutput<Vec4f>("Out", output);
+			setOutput<Vec4f>(rinfo, out_port, output);
+		}
+		/*每个通道16个像素一起求最大值 alpha取中心像素*/
+		virtual void workBatch(const BatchInformation& binfo) {
+			Texture* tex = getLanes(binfo, tex_port).get(0);
+			if (isBinded(uv_port) || !planarBatch(tex, binfo, core)) {
+				Node::workBatch(binfo);
+				return;
+			}
+			Lanes<Vec4f>& out = getLanes(binfo, out_port);
+			tex->reduceWindow(0, binfo.x0, binfo.y, binfo.count, core, WINDOW_MAX, out.r);
+			tex->reduceWindow(1, binfo.x0, binfo.y, binfo.count, core, WINDOW_MAX, out.g);
+			tex->reduceWindow(2, binfo.x0, binfo.y, binfo.count, core, WINDOW_MAX, out.b);
+			for (int i = 0; i < binfo.count; ++i)
+				out.a[i] = tex->get(binfo.x0 + i, binfo.y).a;
 		}
 	};
 
 	/*最值腐蚀（黑而糊） 彩色版*/
 	class Node_Erosion : public Node {
 	private:
+		InputPort<Texture*>* tex_port;
+		InputPort<Vec2f>* uv_port;
+		OutputPort<Vec4f>* out_port;
 		int core = 3; // 2*core+1即卷积核边长
 	public:
 		Node_Erosion(){}
 
 		virtual void setAttributes(vector<string>ss) {
-			sscanf_s(ss[0].c_str(), "%f", core);
+			sscanf_s(ss[0].c_str(), "%d", &core);
 		}
+		virtual bool isVarying() { return !isBinded(uv_port); }
+		virtual int sampleRadius() { return isBinded(uv_port) ? -1 : core; }
+		virtual bool prefersPlanar() { return !isBinded(uv_port); }
 		virtual void definePorts() {
-			defineInputPort<Texture*>("Tex");
-			defineInputPort<Vec2f>("UV");
-			defineOutputPort<Vec4f>("Out");
+			tex_port = defineInputPort<Texture*>("Tex");
+			uv_port = defineInputPort<Vec2f>("UV");
+			out_port = defineOutputPort<Vec4f>("Out");
 		}
 
 		virtual void work(RuntimeInformation rinfo) {
 			Vec2f uv;
-			if (!isBinded("UV")) {
+			if (!isBinded(uv_port)) {
 				uv = rinfo.uv0;
 			}
 			else {
-				uv = getInput<Vec2f>("UV");
+				uv = getInput<Vec2f>(rinfo, uv_port);
 			}
-			Texture* tex = getInput<Texture*>("Tex");
+			Texture* tex = getInput<Texture*>(rinfo, tex_port);
 
 			Vec4f output;
-			std::vector<Color> colors;
+			std::vector<Vec4f> colors;
 
 			// 3x3
-			for (int i = -core; i <= core; i++) {
-				for (int j = -core; j <= core; j++) {
-					Color c = tex->get(uv.u * tex->getPixelWidth() + i, uv.v * tex->getPixelHeight() + j);
-					colors.push_back(c);
-				}
-			}
+			colors.resize((2 * core + 1) * (2 * core + 1));
+			tex->gatherFloat(uv.u * tex->getPixelWidth(), uv.v * tex->getPixelHeight(), core, colors.data());
 
 			// Find RGB min color 
-			auto minColorR = std::min_element(colors.begin(), colors.end(), [](const Color& a, const Color& b) {
+			auto minColorR = std::min_element(colors.begin(), colors.end(), [](const Vec4f& a, const Vec4f& b) {
 				return a.r < b.r;
 				});
-			auto minColorG = std::min_element(colors.begin(), colors.end(), [](const Color& a, const Color& b) {
+			auto minColorG = std::min_element(colors.begin(), colors.end(), [](const Vec4f& a, const Vec4f& b) {
 				return a.g < b.g;
 				});
-			auto minColorB = std::min_element(colors.begin(), colors.end(), [](const Color& a, const Color& b) {
+			auto minColorB = std::min_element(colors.begin(), colors.end(), [](const Vec4f& a, const Vec4f& b) {
 				return a.b < b.b;
 				});
 
@@ -805,7 +1331,21 @@ namespace PhotoGraph {
 
 			output.a = colors[2 * core * core + 2 * core].a; // 卷积核中心点
 
-			setOutput<Vec4f>("Out", output);
+			setOutput<Vec4f>(rinfo, out_port, output);
+		}
+		/*每个通道16个像素一起求最小值 alpha取中心像素*/
+		virtual void workBatch(const BatchInformation& binfo) {
+			Texture* tex = getLanes(binfo, tex_port).get(0);
+			if (isBinded(uv_port) || !planarBatch(tex, binfo, core)) {
+				Node::workBatch(binfo);
+				return;
+			}
+			Lanes<Vec4f>& out = getLanes(binfo, out_port);
+			tex->reduceWindow(0, binfo.x0, binfo.y, binfo.count, core, WINDOW_MIN, out.r);
+			tex->reduceWindow(1, binfo.x0, binfo.y, binfo.count, core, WINDOW_MIN, out.g);
+			tex->reduceWindow(2, binfo.x0, binfo.y, binfo.count, core, WINDOW_MIN, out.b);
+			for (int i = 0; i < binfo.count; ++i)
+				out.a[i] = tex->get(binfo.x0 + i, binfo.y).a;
 		}
 	};
 
@@ -813,45 +1353,46 @@ namespace PhotoGraph {
 	/*边缘检测  轮廓提取 彩色*/
 	class Node_EdgeDetection : public Node {
 	private:
+		InputPort<Texture*>* tex_port;
+		InputPort<Vec2f>* uv_port;
+		OutputPort<Vec4f>* out_port;
 		int core = 1; // 2*core+1即卷积核边长
 	public:
 		Node_EdgeDetection() {}
 		virtual void setAttributes(vector<string>ss) {
-			sscanf_s(ss[0].c_str(), "%f", core);
+			sscanf_s(ss[0].c_str(), "%d", &core);
 		}
 
+		virtual bool isVarying() { return !isBinded(uv_port); }
+		virtual int sampleRadius() { return isBinded(uv_port) ? -1 : core; }
 		virtual void definePorts() {
-			defineInputPort<Texture*>("Tex");
-			defineInputPort<Vec2f>("UV");
-			defineOutputPort<Vec4f>("Out");
+			tex_port = defineInputPort<Texture*>("Tex");
+			uv_port = defineInputPort<Vec2f>("UV");
+			out_port = defineOutputPort<Vec4f>("Out");
 		}
 
 		virtual void work(RuntimeInformation rinfo) {
 			Vec2f uv;
-			if (!isBinded("UV")) {
+			if (!isBinded(uv_port)) {
 				uv = rinfo.uv0;
 			}
 			else {
-				uv = getInput<Vec2f>("UV");
+				uv = getInput<Vec2f>(rinfo, uv_port);
 			}
-			Texture* tex = getInput<Texture*>("Tex");
+			Texture* tex = getInput<Texture*>(rinfo, tex_port);
 
 			Vec4f output;
-			std::vector<Color> colors;
+			std::vector<Vec4f> colors;
 
 			// 3x3
-			for (int i = -core; i <= core; i++) {
-				for (int j = -core; j <= core; j++) {
-					Color c = tex->get(uv.u * tex->getPixelWidth() + i, uv.v * tex->getPixelHeight() + j);
-					colors.push_back(c);
-				}
-			}
+			colors.resize((2 * core + 1) * (2 * core + 1));
+			tex->gatherFloat(uv.u * tex->getPixelWidth(), uv.v * tex->getPixelHeight(), core, colors.data());
 			// Calculate abs  between center and neighbors
-			Color centerColor = colors[core * (2 * core + 1) + core];
+			Vec4f centerColor = colors[core * (2 * core + 1) + core];
 			float diffR = 0.0;
 			float diffG = 0.0;
 			float diffB = 0.0;
-			for (const Color& c : colors) {
+			for (const Vec4f& c : colors) {
 				diffR += std::abs(c.r - centerColor.r);
 				diffG += std::abs(c.g - centerColor.g);
 				diffB += std::abs(c.b - centerColor.b);
@@ -860,7 +1401,7 @@ namespace PhotoGraph {
 			output.g = diffG;
 			output.b = diffB;
 			output.a = centerColor.a;
-			setOutput<Vec4f>("Out", output);
+			setOutput<Vec4f>(rinfo, out_port, output);
 		}
 	};
 
@@ -869,144 +1410,178 @@ namespace PhotoGraph {
 
 	/*less equal*/
 	class Node_floatLE : public Node {
+	private:
+		InputPort<float>* in1_port;
+		InputPort<float>* in2_port;
+		OutputPort<float>* out_port;
 	public:
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<float>("In1");
-			defineInputPort<float>("In2");
-			defineOutputPort<float>("Out");
+			in1_port = defineInputPort<float>("In1");
+			in2_port = defineInputPort<float>("In2");
+			out_port = defineOutputPort<float>("Out");
 		}
 		virtual void  work(RuntimeInformation rinfo) {
 
-			float f1 = getInput<float>("In1");
-			float f2 = getInput<float>("In1");
+			float f1 = getInput<float>(rinfo, in1_port);
+			float f2 = getInput<float>(rinfo, in1_port);
 			float output;
 			if (f1 <= f2) output = f1;
 			else  output = f2;
-			setOutput<float>("Out", output);
+			setOutput<float>(rinfo, out_port, output);
 		}
 	};
 
 	/*less */
 	class Node_floatL : public Node {
+	private:
+		InputPort<float>* in1_port;
+		InputPort<float>* in2_port;
+		OutputPort<float>* out_port;
 	public:
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<float>("In1");
-			defineInputPort<float>("In2");
-			defineOutputPort<float>("Out");
+			in1_port = defineInputPort<float>("In1");
+			in2_port = defineInputPort<float>("In2");
+			out_port = defineOutputPort<float>("Out");
 		}
 		virtual void  work(RuntimeInformation rinfo) {
 
-			float f1 = getInput<float>("In1");
-			float f2 = getInput<float>("In1");
+			float f1 = getInput<float>(rinfo, in1_port);
+			float f2 = getInput<float>(rinfo, in1_port);
 			float output;
 			if (f1 < f2) output = f1;
 			else  output = f2;
-			setOutput<float>("Out", output);
+			setOutput<float>(rinfo, out_port, output);
 		}
 	};
 
 
 	//abs
 	class Node_floatABS : public Node {
+	private:
+		InputPort<float>* in_port;
+		OutputPort<float>* out_port;
 	public:
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<float>("In");
-			defineOutputPort<float>("Out");
+			in_port = defineInputPort<float>("In");
+			out_port = defineOutputPort<float>("Out");
 		}
 		virtual void  work(RuntimeInformation rinfo) {
-			float f = getInput<float>("In");
-			setOutput<float>("Out", abs(f));
+			float f = getInput<float>(rinfo, in_port);
+			setOutput<float>(rinfo, out_port, abs(f));
 		}
 	};
 
 	//range
 	class Node_Range : public Node {
 	private:
+		InputPort<float>* in_port;
+		OutputPort<float>* out_port;
 		float min=0;
 		float max=255;
 	public:
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<float>("In");
-			defineOutputPort<float>("Out");
+			in_port = defineInputPort<float>("In");
+			out_port = defineOutputPort<float>("Out");
 		}
 		virtual void  work(RuntimeInformation rinfo) {
-			float f = getInput<float>("In");
+			float f = getInput<float>(rinfo, in_port);
 
 			if (f < min) f = min;
 			else if (f > max) f = max;
-			setOutput<float>("Out", abs(f));
+			setOutput<float>(rinfo, out_port, abs(f));
 		}
 	};
 
 
 	/*无参生成随机float*/
 	class Node_RandomFloat : public Node {
+	private:
+		OutputPort<float>* out_port;
 	public:
+		virtual bool isDeterministic() { return false; }
 		virtual void definePorts() {
-			defineOutputPort<float>("Out");
+			out_port = defineOutputPort<float>("Out");
 		}
 		virtual void  work(RuntimeInformation rinfo) {
 			std::random_device rd;
 			std::mt19937 gen(rd());
 			std::uniform_real_distribution<float> dis(0.0f,255.0f);
-			setOutput<float>("Out", dis(gen));
+			setOutput<float>(rinfo, out_port, dis(gen));
 		}
 	};
 
 	/*float*Vec4f*/
 	class Node_floatXVec4f : public Node {
+	private:
+		InputPort<Vec4f>* vec_port;
+		InputPort<float>* float_port;
+		OutputPort<Vec4f>* out_port;
 	public:
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<Vec4f>("Vec4fIn");
-			defineInputPort<float>("floatIn");
-			defineOutputPort< Vec4f >("Out");
+			vec_port = defineInputPort<Vec4f>("Vec4fIn");
+			float_port = defineInputPort<float>("floatIn");
+			out_port = defineOutputPort< Vec4f >("Out");
 		}
 		virtual void  work(RuntimeInformation rinfo) {
-			Vec4f v=getInput<Vec4f>("Vec4fIn");
-			float f= getInput<float>("floatIn");
+			Vec4f v=getInput<Vec4f>(rinfo, vec_port);
+			float f= getInput<float>(rinfo, float_port);
 			v.r *= f; v.g *= f; v.b *= f; 
-			setOutput<Vec4f>("Out",v);
+			setOutput<Vec4f>(rinfo, out_port,v);
 		}
 	};
 
 	class Node_Threshold : public Node {
+	private:
+		InputPort<Vec4f>* in_port;
+		OutputPort<Vec4f>* out_port;
 	public:
 		Node_Threshold() {}
 
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<cv::Vec4f>("In");
-			defineOutputPort<cv::Vec4f>("Out");
+			in_port = defineInputPort<Vec4f>("In");
+			out_port = defineOutputPort<Vec4f>("Out");
 		}
 
 		virtual void work(RuntimeInformation rinfo) {
-			Vec4f inputVec4f = getInput<Vec4f>("In");
+			Vec4f inputVec4f = getInput<Vec4f>(rinfo, in_port);
 			inputVec4f.r > 255 ? 255 : inputVec4f.r;
 			inputVec4f.r <  0  ?   0 : inputVec4f.r;
 			inputVec4f.g > 255 ? 255 : inputVec4f.g;
 			inputVec4f.g < 0 ? 0 : inputVec4f.g;
 			inputVec4f.b > 255 ? 255 : inputVec4f.b;
 			inputVec4f.b < 0 ? 0 : inputVec4f.b;
-			setOutput<Vec4f>("Out", inputVec4f);
+			setOutput<Vec4f>(rinfo, out_port, inputVec4f);
 		}
 	};
 
 	/*Vec4f*Matrix*/
 	class Node_Vec4fXMatrix : public Node {
+	private:
+		InputPort<Vec4f>* vec_port;
+		InputPort<Matrix4x4>* mat_port;
+		OutputPort<Vec4f>* out_port;
 	public:
+		virtual bool isVarying() { return false; }
 		virtual void definePorts() {
-			defineInputPort<Vec4f>("Vec4fIn");
-			defineInputPort<Matrix4x4>("MatIn");
-			defineOutputPort<Vec4f>("Out");
+			vec_port = defineInputPort<Vec4f>("Vec4fIn");
+			mat_port = defineInputPort<Matrix4x4>("MatIn");
+			out_port = defineOutputPort<Vec4f>("Out");
 		}
 		virtual void  work(RuntimeInformation rinfo) {
-			Vec4f v = getInput<Vec4f>("Vec4fIn");
-			Matrix4x4 M = getInput<Matrix4x4>("MatIn");
+			Vec4f v = getInput<Vec4f>(rinfo, vec_port);
+			Matrix4x4 M = getInput<Matrix4x4>(rinfo, mat_port);
 			Vec4f result;
 			result.r = M.raw[0].r * v.r + M.raw[1].r * v.g + M.raw[2].r * v.b + M.raw[3].r * v.a;
 			result.g = M.raw[0].g * v.r + M.raw[1].g * v.g + M.raw[2].g * v.b + M.raw[3].g * v.a;
 			result.b = M.raw[0].b * v.r + M.raw[1].b * v.g + M.raw[2].b * v.b + M.raw[3].b * v.a;
 			result.a = M.raw[0].a * v.r + M.raw[1].a * v.g + M.raw[2].a * v.b + M.raw[3].a * v.a;
-			setOutput<Vec4f>("Out", result);
+			setOutput<Vec4f>(rinfo, out_port, result);
 		}
 	};
 
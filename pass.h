@@ -3,9 +3,20 @@
 #ifndef _PASS_H
 #define _PASS_H
 
-#include "node.h"
+#include "fusion.h"
+#include "program.h"
+#include "texture_pool.h"
+#include "thread_pool.h"
+#include "tiled_file.h"
 #include "vector"
+#include <algorithm>
+#include <atomic>
 #include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <iostream>
 
 namespace PhotoGraph {
@@ -15,28 +26,146 @@ namespace PhotoGraph {
 		virtual ~NoOutputNodeException() throw() {}
 	};
 
+	class RenderCancelledException : public std::runtime_error {
+	public:
+		RenderCancelledException() : std::runtime_error("Render was cancelled or superseded") {}
+		virtual ~RenderCancelledException() throw() {}
+	};
+
+	class StreamingNotSupportedException : public std::logic_error {
+	public:
+		StreamingNotSupportedException(const std::string& reason) : std::logic_error(reason) {}
+		virtual ~StreamingNotSupportedException() throw() {}
+	};
+
+	/*异步渲染的取消标记 被新的请求取代时置为true*/
+	typedef std::shared_ptr<std::atomic<bool> > CancellationToken;
+
+	const int TILE_SIZE = BATCH_SIZE; /*tile的一行正好是一个batch*/
+	const int PROGRESSIVE_STEP = 8; /*渐进式渲染的第一层每8x8个像素采样一次*/
+	const int STREAM_TILE_SIZE = 1024; /*流式渲染每次处理的输出区域边长 决定峰值内存*/
+	const size_t STAGE_CACHE_BUDGET = (size_t)256 << 20; /*所有Stage增量缓存合计的默认字节数上限*/
+	const int BLOCKED_SAMPLE_RADIUS = 2; /*下游采样半径不小于此值的纹理改用BLOCKED布局 3行以内按行读取已足够*/
+
+	/*增量渲染时按batch缓存前沿节点的输出 前沿即自身未受影响但被受影响节点使用的节点*/
+	struct StageCache {
+		std::vector<Node*> frontier;
+		std::vector<std::pair<size_t, size_t> > ranges; /*各前沿节点输出端口在ExecutionState中的[begin, end)*/
+		size_t batch_bytes;
+		std::vector<unsigned char> data;
+		StageCache(const std::vector<Node*>& frontier, const std::vector<std::pair<size_t, size_t> >& ranges, int batches)
+			: frontier(frontier), ranges(ranges), batch_bytes(0) {
+			for (int i = 0; i < ranges.size(); ++i)
+				batch_bytes += ranges[i].second - ranges[i].first;
+			data.resize(batch_bytes * batches);
+		}
+		/*记录batches个batch的前沿需要的字节数*/
+		static size_t bytesFor(const std::vector<std::pair<size_t, size_t> >& ranges, int batches) {
+			size_t bytes = 0;
+			for (int i = 0; i < ranges.size(); ++i)
+				bytes += ranges[i].second - ranges[i].first;
+			return bytes * batches;
+		}
+		inline size_t size() { return data.size(); }
+		void store(ExecutionState& state, int batch) {
+			unsigned char* p = data.data() + batch * batch_bytes;
+			for (int i = 0; i < ranges.size(); ++i) {
+				size_t bytes = ranges[i].second - ranges[i].first;
+				memcpy(p, &state.at<unsigned char>(ranges[i].first), bytes);
+				p += bytes;
+			}
+		}
+		void restore(ExecutionState& state, int batch) {
+			unsigned char* p = data.data() + batch * batch_bytes;
+			for (int i = 0; i < ranges.size(); ++i) {
+				size_t bytes = ranges[i].second - ranges[i].first;
+				memcpy(&state.at<unsigned char>(ranges[i].first), p, bytes);
+				p += bytes;
+			}
+		}
+	};
+
+	/*以一个输出节点为终点的子图 Node_RenderTexture把整张图切分成依次渲染的多个Stage*/
+	struct Stage {
+		Node_Output* sink;
+		std::vector<Node_RenderTexture*> sources; /*之前的Stage已经渲染好的中间纹理*/
+		std::vector<Node*> uniform_sequence; /*与像素无关的节点 每次渲染只求值一次*/
+		std::vector<Node*> pixel_sequence;
+		Program uniform_program;
+		Program program;
+		FusedKernel* fused; /*整条链可融合时代替program*/
+		std::vector<Node*> sequence; /*不含sources 按拓扑序*/
+		std::set<Node*> members;
+		StageCache* cache;
+		Stage() : sink(NULL), fused(NULL), cache(NULL) {}
+		~Stage() {
+			delete fused;
+			delete cache;
+		}
+	};
+
 	class Pass {
 	private:
 		std::map<std::string, Node*> node_map_;
 		std::vector<Node*> node_sequence_;
+		std::vector<Stage*> stages_; /*按依赖顺序排列 最后一个以output为终点*/
+		TexturePool texture_pool_;
 		//两者size不同说明有环
 		Node_Output* output;
 		Texture* tex;
+		size_t pruned_count_; /*不可达Node_Output而被剔除的节点数*/
+		size_t merged_count_; /*与其他节点等价而被合并的节点数*/
+		/*一次合并 撤销时恢复node的上下游连接*/
+		struct MergeRecord {
+			Node* node;
+			Node* survivor;
+			std::set<Node*> upstream;
+			std::map<Node*, PortBindings> consumers;
+		};
+		std::vector<MergeRecord> merges_; /*按合并顺序*/
+		std::set<Node*> dirty_; /*上次渲染之后属性被修改的节点*/
+		bool compiled_; /*图结构自上次compile之后没有变化 可以增量渲染*/
+		size_t state_size_;
+		size_t cache_budget_; /*Stage增量缓存合计的字节数上限 超出时不缓存 该Stage每次完整渲染*/
+		std::map<Node*, std::pair<size_t, size_t> > node_slots_; /*各节点输出端口占用的[begin, end)*/
+		std::recursive_mutex render_mutex_; /*同一时刻只有一次渲染或图的修改在使用Stage与节点 修改图时会嵌套加锁*/
+		std::mutex token_mutex_;
+		CancellationToken latest_token_; /*最近一次workAsync的标记*/
+		const std::atomic<bool>* cancel_; /*当前渲染的取消标记 同步渲染时为NULL*/
+		inline bool isCancelled() {
+			return cancel_ != NULL && cancel_->load();
+		}
 	public:
-		Pass() : output(NULL), tex(NULL) {}
+		Pass() : output(NULL), tex(NULL), pruned_count_(0), merged_count_(0), compiled_(false), state_size_(0), cache_budget_(STAGE_CACHE_BUDGET), cancel_(NULL) {}
+		~Pass() {
+			cancel();
+			std::lock_guard<std::recursive_mutex> lock(render_mutex_);
+			releaseTargets();
+			clearStages();
+			texture_pool_.release(tex);
+		}
 		void check() {
 			cout << output << endl;
 		}
+		/*修改图的接口先取消正在进行的异步渲染 再等它在下一个tile处停止 不会与渲染线程同时访问节点*/
 		template <class T> 
 		void defineNode(std::string node_name, vector<string>ss) {
+			cancel();
+			std::lock_guard<std::recursive_mutex> lock(render_mutex_);
+			compiled_ = false;
 			Node* node = new T();
+			node->attributes = ss;
 			node->setAttributes(ss);
 			node_map_[node_name] = node;
 			node->definePorts();
 		}
 		template <>
 		void defineNode<Node_Output>(std::string node_name,vector<string>ss) {
+			cancel();
+			std::lock_guard<std::recursive_mutex> lock(render_mutex_);
+			compiled_ = false;
 			output = new Node_Output();
+			output->attributes = ss;
 			output->setAttributes(ss);
 			node_map_[node_name] = output;
 			output->definePorts();
@@ -48,14 +177,65 @@ namespace PhotoGraph {
 			return NULL;
 		}
 		void bind(std::string output_node, std::string output_port, std::string input_node, std::string input_port) {
+			cancel();
+			std::lock_guard<std::recursive_mutex> lock(render_mutex_);
 			Node* opn = getNode<Node>(output_node);
 			Node* ipn = getNode<Node>(input_node);
-			if (opn != NULL && ipn != NULL) opn->bind(output_port, ipn, input_port);
+			if (opn == NULL || ipn == NULL) return;
+			compiled_ = false;
+			/*颜色接到纹理输入上时插入中间纹理 上游先渲染成Texture再供邻域节点采样*/
+			if (dynamic_cast<OutputPort<Vec4f>*>(opn->getOutputPort(output_port)) != NULL &&
+				dynamic_cast<InputPort<Texture*>*>(ipn->getInputPort(input_port)) != NULL) {
+				std::string rt_name = output_node + "." + output_port + ".RenderTexture";
+				if (getNode<Node>(rt_name) == NULL) {
+					defineNode<Node_RenderTexture>(rt_name, vector<string>());
+					opn->bind(output_port, getNode<Node>(rt_name), "In");
+				}
+				getNode<Node>(rt_name)->bind("Tex", ipn, input_port);
+				return;
+			}
+			opn->bind(output_port, ipn, input_port);
+		}
+		/*修改节点属性 下次work只重新计算受影响的下游节点*/
+		void setAttributes(std::string node_name, vector<string>ss) {
+			cancel();
+			std::lock_guard<std::recursive_mutex> lock(render_mutex_);
+			Node* node = getNode<Node>(node_name);
+			if (node == NULL) return;
+			node->attributes = ss;
+			node->setAttributes(ss);
+			/*输出尺寸可能改变 需要重新compile*/
+			if (dynamic_cast<Node_Output*>(node) != NULL) compiled_ = false;
+			/*合并过的节点修改后可能不再等价 恢复原图重新生成序列*/
+			if (isMerged(node)) sequenceGeneration();
+			dirty_.insert(node);
+		}
+		/*节点内容在Pass之外被修改时(如替换Node_Texture的tex)调用*/
+		void markDirty(std::string node_name) {
+			cancel();
+			std::lock_guard<std::recursive_mutex> lock(render_mutex_);
+			Node* node = getNode<Node>(node_name);
+			if (node == NULL) return;
+			Node_Texture* texture = dynamic_cast<Node_Texture*>(node);
+			if (texture != NULL) {
+				/*TextureCache中的像素不会改变 只有调用者自己提供的tex需要重新计算mip与统计*/
+				if (texture->tex != NULL && texture->tex != texture->source.get()) texture->tex->markModified();
+				texture->invalidateView();
+			}
+			if (isMerged(node)) sequenceGeneration();
+			dirty_.insert(node);
 		}
 		void sequenceGeneration() {
+			cancel();
+			std::lock_guard<std::recursive_mutex> lock(render_mutex_);
+			compiled_ = false;
+			unmergeDuplicates();
 			std::map<std::string, Node*>::iterator it;
 			std::set<Node*>::iterator it2;
+			std::map<Node*, size_t> in_degree; /*不修改dependency_set 编译时还要用到*/
+			node_sequence_.clear();
 			for (it = node_map_.begin(); it != node_map_.end(); it++) {
+				in_degree[(*it).second] = (*it).second->dependency_set.size();
 				if ((*it).second->dependency_set.size() == 0) {
 					node_sequence_.push_back((*it).second);
 				}
@@ -63,33 +243,583 @@ namespace PhotoGraph {
 			for (int i = 0; i < node_sequence_.size(); ++i) {
 				Node* nNode = node_sequence_[i];
 				for (it2 = nNode->binded_set.begin(); it2 != nNode->binded_set.end(); it2++) {
-					(*it2)->dependency_set.erase(nNode);
-					if ((*it2)->dependency_set.size() == 0) {
+					if (--in_degree[*it2] == 0) {
 						node_sequence_.push_back((*it2));
 					}
 				}
 			}
+			pruneUnreachable();
+			mergeDuplicates();
+		}
+		/*从输出节点沿dependency_set反向遍历 剔除对输出没有贡献的节点*/
+		void pruneUnreachable() {
+			pruned_count_ = 0;
+			if (output == NULL) return;
+			std::set<Node*> reachable;
+			std::vector<Node*> stack(1, output);
+			std::set<Node*>::iterator it;
+			reachable.insert(output);
+			while (!stack.empty()) {
+				Node* node = stack.back();
+				stack.pop_back();
+				for (it = node->dependency_set.begin(); it != node->dependency_set.end(); it++)
+					if (reachable.insert(*it).second) stack.push_back(*it);
+			}
+			std::vector<Node*> live;
+			for (int i = 0; i < node_sequence_.size(); ++i) {
+				if (reachable.find(node_sequence_[i]) != reachable.end()) live.push_back(node_sequence_[i]);
+				else pruned_count_++;
+			}
+			node_sequence_.swap(live);
+			if (pruned_count_ > 0) cout << "pruned " << pruned_count_ << " unused nodes" << endl;
+		}
+		inline size_t getPrunedCount() { return pruned_count_; }
+		/*按拓扑序把signature与输入绑定都相同的节点合并 下游改接到保留的节点上*/
+		void mergeDuplicates() {
+			std::map<std::string, Node*> survivors;
+			std::vector<Node*> kept;
+			std::set<Node*>::iterator it;
+			merged_count_ = 0;
+			for (int i = 0; i < node_sequence_.size(); ++i) {
+				Node* node = node_sequence_[i];
+				if (node == output || !node->isDeterministic()) {
+					kept.push_back(node);
+					continue;
+				}
+				std::string key = node->signature() + "#" + node->describeBindings();
+				std::map<std::string, Node*>::iterator found = survivors.find(key);
+				if (found == survivors.end()) {
+					survivors[key] = node;
+					kept.push_back(node);
+					continue;
+				}
+				MergeRecord record;
+				record.node = node;
+				record.survivor = found->second;
+				record.upstream = node->dependency_set;
+				std::set<Node*> consumers = node->binded_set;
+				for (it = consumers.begin(); it != consumers.end(); it++)
+					(*it)->replaceUpstream(node, found->second, &record.consumers[*it]);
+				for (it = node->dependency_set.begin(); it != node->dependency_set.end(); it++)
+					(*it)->binded_set.erase(node);
+				node->dependency_set.clear();
+				merges_.push_back(record);
+				merged_count_++;
+			}
+			node_sequence_.swap(kept);
+			if (merged_count_ > 0) cout << "merged " << merged_count_ << " duplicate nodes" << endl;
+		}
+		inline size_t getMergedCount() { return merged_count_; }
+		/*按相反顺序撤销合并 后面的合并可能依赖前面合并后的绑定*/
+		void unmergeDuplicates() {
+			std::set<Node*>::iterator it;
+			std::map<Node*, PortBindings>::iterator consumer;
+			for (int i = (int)merges_.size() - 1; i >= 0; --i) {
+				MergeRecord& record = merges_[i];
+				record.node->dependency_set = record.upstream;
+				for (it = record.upstream.begin(); it != record.upstream.end(); it++)
+					(*it)->binded_set.insert(record.node);
+				for (consumer = record.consumers.begin(); consumer != record.consumers.end(); consumer++)
+					consumer->first->restoreUpstream(record.node, record.survivor, consumer->second);
+			}
+			merges_.clear();
+			merged_count_ = 0;
+		}
+		/*节点被合并掉或有其他节点合并到它上面*/
+		bool isMerged(Node* node) {
+			for (int i = 0; i < merges_.size(); ++i)
+				if (merges_[i].node == node || merges_[i].survivor == node) return true;
+			return false;
+		}
+		/*中间纹理归还给纹理池 输出纹理由prepare管理*/
+		void releaseTargets() {
+			for (int i = 0; i < stages_.size(); ++i) {
+				if (stages_[i]->sink == output) continue;
+				texture_pool_.release(stages_[i]->sink->target);
+				stages_[i]->sink->target = NULL;
+			}
+		}
+		void clearStages() {
+			for (int i = 0; i < stages_.size(); ++i)
+				delete stages_[i];
+			stages_.clear();
+		}
+		/*从sink沿dependency_set反向收集 遇到Node_RenderTexture即停止 它属于更早的Stage*/
+		Stage* buildStage(Node_Output* sink) {
+			Stage* stage = new Stage();
+			stage->sink = sink;
+			std::set<Node*> members;
+			std::vector<Node*> stack(1, sink);
+			std::set<Node*>::iterator it;
+			members.insert(sink);
+			while (!stack.empty()) {
+				Node* node = stack.back();
+				stack.pop_back();
+				for (it = node->dependency_set.begin(); it != node->dependency_set.end(); it++) {
+					if (!members.insert(*it).second) continue;
+					Node_RenderTexture* rt = dynamic_cast<Node_RenderTexture*>(*it);
+					if (rt != NULL) stage->sources.push_back(rt);
+					else stack.push_back(*it);
+				}
+			}
+			std::vector<Node*> sequence;
+			for (int i = 0; i < stage->sources.size(); ++i)
+				members.erase(stage->sources[i]);
+			for (int i = 0; i < node_sequence_.size(); ++i)
+				if (members.find(node_sequence_[i]) != members.end()) sequence.push_back(node_sequence_[i]);
+			stage->members.swap(members);
+			stage->sequence.swap(sequence);
+			hoistInvariants(stage, stage->sequence);
+			lowerStage(stage);
+			return stage;
+		}
+		/*指令中带有节点属性 属性修改后需要重新生成*/
+		void lowerStage(Stage* stage) {
+			stage->uniform_program.compile(stage->uniform_sequence);
+			stage->program.compile(stage->pixel_sequence);
+			delete stage->fused;
+			stage->fused = matchFusedKernel(stage->sequence, stage->sink);
+		}
+		/*自身不随像素变化且上游全部不变的节点移出逐像素Program 已渲染好的中间纹理也是不变的*/
+		void hoistInvariants(Stage* stage, const std::vector<Node*>& sequence) {
+			std::set<Node*> invariant(stage->sources.begin(), stage->sources.end());
+			std::set<Node*>::iterator it;
+			for (int i = 0; i < sequence.size(); ++i) {
+				Node* node = sequence[i];
+				bool hoist = !node->isVarying();
+				for (it = node->dependency_set.begin(); it != node->dependency_set.end(); it++)
+					if (invariant.find(*it) == invariant.end()) hoist = false;
+				if (hoist) {
+					invariant.insert(node);
+					stage->uniform_sequence.push_back(node);
+				}
+				else stage->pixel_sequence.push_back(node);
+			}
+		}
+		/*分配端口位置 把输入端口解析为固定偏移并为每个Stage生成Program 返回ExecutionState大小*/
+		/*streamed中的Node_Texture由流式渲染替换为源窗口 不从TextureCache加载*/
+		size_t compile(const std::set<Node*>* streamed = NULL) {
+			size_t state_size = NULL_SLOT_SIZE;
+			node_slots_.clear();
+			for (int i = 0; i < node_sequence_.size(); ++i) {
+				size_t begin = state_size;
+				state_size = node_sequence_[i]->layout(state_size);
+				node_slots_[node_sequence_[i]] = std::make_pair(begin, state_size);
+			}
+			for (int i = 0; i < node_sequence_.size(); ++i)
+				node_sequence_[i]->resolve();
+			/*任何一个Stage的输出尺寸都可能是纹理被采样的尺寸 取其中最大的*/
+			int width = output->width, height = output->height;
+			for (int i = 0; i < node_sequence_.size(); ++i) {
+				Node_RenderTexture* rt = dynamic_cast<Node_RenderTexture*>(node_sequence_[i]);
+				if (rt == NULL || !rt->sized) continue;
+				width = std::max(width, rt->width);
+				height = std::max(height, rt->height);
+			}
+			for (int i = 0; i < node_sequence_.size(); ++i) {
+				Node_Texture* texture = dynamic_cast<Node_Texture*>(node_sequence_[i]);
+				if (texture == NULL) continue;
+				int radius = 0;
+				bool planar = false;
+				std::set<Node*>::iterator it;
+				for (it = texture->binded_set.begin(); it != texture->binded_set.end(); it++) {
+					/*Sample Texture的双线性采样经texel()钳位到纹理内 不读取apron 不需要为它复制纹理*/
+					if (dynamic_cast<Node_Sample_Texture*>(*it) == NULL) radius = std::max(radius, (*it)->sampleRadius());
+					planar = planar || (*it)->prefersPlanar();
+				}
+				texture->setSampling(planar ? PLANAR : radius >= BLOCKED_SAMPLE_RADIUS ? BLOCKED : LINEAR, radius);
+				if (streamed != NULL && streamed->count(texture) > 0) continue;
+				/*只被固定uv的Sample Texture读取时可以缩小解码 邻域节点和任意uv需要原始像素*/
+				bool point_sampled = !texture->binded_set.empty();
+				for (it = texture->binded_set.begin(); it != texture->binded_set.end(); it++)
+					if (dynamic_cast<Node_Sample_Texture*>(*it) == NULL || (*it)->sampleRadius() < 0) point_sampled = false;
+				if (point_sampled) texture->setResolution(width, height);
+				else texture->setResolution(0, 0);
+			}
+			releaseTargets();
+			clearStages();
+			for (int i = 0; i < node_sequence_.size(); ++i) {
+				Node_RenderTexture* rt = dynamic_cast<Node_RenderTexture*>(node_sequence_[i]);
+				if (rt == NULL) continue;
+				if (!rt->sized) {
+					rt->width = output->width;
+					rt->height = output->height;
+				}
+				stages_.push_back(buildStage(rt));
+			}
+			stages_.push_back(buildStage(output));
+			return state_size;
 		}
+		/*求值与像素无关的节点并广播到整个batch 作为各线程ExecutionState的初值*/
+		ExecutionState evaluateUniforms(Stage* stage) {
+			ExecutionState uniforms(state_size_);
+			std::set<Node*>::iterator it;
+			for (it = stage->members.begin(); it != stage->members.end(); it++) {
+				Node_Texture* texture = dynamic_cast<Node_Texture*>(*it);
+				if (texture != NULL) texture->refreshView();
+			}
+			for (int i = 0; i < stage->sources.size(); ++i)
+				stage->sources[i]->publish(&uniforms);
+			BatchInformation uinfo;
+			uinfo.state = &uniforms;
+			uinfo.count = 1;
+			uinfo.width = stage->sink->width;
+			uinfo.height = stage->sink->height;
+			stage->uniform_program.run(uinfo);
+			for (int i = 0; i < stage->uniform_sequence.size(); ++i)
+				stage->uniform_sequence[i]->broadcast(&uniforms);
+			for (it = stage->members.begin(); it != stage->members.end(); it++) {
+				Node_AdjustContrast* contrast = dynamic_cast<Node_AdjustContrast*>(*it);
+				if (contrast != NULL) contrast->prefetch(&uniforms);
+			}
+			return uniforms;
+		}
+		/*nodes或它们的任一上游节点在affected中 affected为NULL时视为全部受影响*/
+		bool reachesAffected(const std::vector<Node*>& nodes, const std::set<Node*>* affected) {
+			if (affected == NULL) return true;
+			std::set<Node*> visited;
+			std::vector<Node*> pending(nodes.begin(), nodes.end());
+			while (!pending.empty()) {
+				Node* node = pending.back();
+				pending.pop_back();
+				if (!visited.insert(node).second) continue;
+				if (affected->find(node) != affected->end()) return true;
+				pending.insert(pending.end(), node->dependency_set.begin(), node->dependency_set.end());
+			}
+			return false;
+		}
+		/*各Stage增量缓存当前占用的字节数*/
+		size_t cacheBytes() {
+			size_t bytes = 0;
+			for (int i = 0; i < stages_.size(); ++i)
+				if (stages_[i]->cache != NULL) bytes += stages_[i]->cache->size();
+			return bytes;
+		}
+		/*超出新的上限时丢弃所有缓存 为0时不再缓存*/
+		void setCacheBudget(size_t bytes) {
+			std::lock_guard<std::recursive_mutex> lock(render_mutex_);
+			cache_budget_ = bytes;
+			if (cacheBytes() <= cache_budget_) return;
+			for (int i = 0; i < stages_.size(); ++i) {
+				delete stages_[i]->cache;
+				stages_[i]->cache = NULL;
+			}
+		}
+		/*affected中的节点需要重新计算 为NULL时整个Stage全部重新计算*/
+		void renderStage(Stage* stage, const std::set<Node*>* affected) {
+			Node_Output* sink = stage->sink;
+			int tiles_x = (sink->width + TILE_SIZE - 1) / TILE_SIZE;
+			int tiles_y = (sink->height + TILE_SIZE - 1) / TILE_SIZE;
+
+			/*前沿节点与上次相同时从缓存恢复 只运行受影响的节点 否则完整运行并记录前沿*/
+			std::vector<Node*> frontier;
+			std::vector<Node*> partial;
+			std::set<Node*>::iterator it;
+			for (int i = 0; affected != NULL && i < stage->pixel_sequence.size(); ++i) {
+				Node* node = stage->pixel_sequence[i];
+				if (affected->find(node) != affected->end()) {
+					partial.push_back(node);
+					continue;
+				}
+				for (it = node->binded_set.begin(); it != node->binded_set.end(); it++)
+					if (affected->find(*it) != affected->end()) break;
+				if (it != node->binded_set.end()) frontier.push_back(node);
+			}
+			/*前沿不同(包括本次没有前沿的完整渲染)或缓存的前沿及其上游被修改时 缓存的值已经过期*/
+			if (stage->cache != NULL && (stage->cache->frontier != frontier || reachesAffected(stage->cache->frontier, affected))) {
+				delete stage->cache;
+				stage->cache = NULL;
+			}
+			bool replay = !frontier.empty() && stage->cache != NULL;
+			if (!frontier.empty() && !replay) {
+				std::vector<std::pair<size_t, size_t> > ranges;
+				for (int i = 0; i < frontier.size(); ++i)
+					ranges.push_back(node_slots_[frontier[i]]);
+				if (cacheBytes() + StageCache::bytesFor(ranges, tiles_x * sink->height) <= cache_budget_)
+					stage->cache = new StageCache(frontier, ranges, tiles_x * sink->height);
+			}
+			if (affected != NULL) lowerStage(stage);
+			Program partial_program;
+			if (replay) partial_program.compile(partial);
+			Program& program = replay ? partial_program : stage->program;
+			StageCache* cache = frontier.empty() ? NULL : stage->cache;
+			FusedKernel* fused = cache == NULL ? stage->fused : NULL;
+
+			ThreadPool& pool = ThreadPool::global();
+			std::vector<ExecutionState> states(pool.concurrency(), evaluateUniforms(stage));
+			pool.parallelFor(tiles_x * tiles_y, [&](int tile, int worker) {
+				if (isCancelled()) return;
+				BatchInformation binfo;
+				binfo.state = &states[worker];
+				binfo.width = sink->width;
+				binfo.height = sink->height;
+				binfo.x0 = tile % tiles_x * TILE_SIZE;
+				binfo.count = std::min(TILE_SIZE, sink->width - binfo.x0);
+				int y0 = tile / tiles_x * TILE_SIZE;
+				int y1 = std::min(y0 + TILE_SIZE, sink->height);
+				for (binfo.y = y0; binfo.y < y1; ++binfo.y) {
+					int batch = binfo.y * tiles_x + tile % tiles_x;
+					if (fused != NULL) {
+						fused->runRow(sink->target, binfo.x0, binfo.y, binfo.count, binfo.width, binfo.height);
+						continue;
+					}
+					if (replay) cache->restore(*binfo.state, batch);
+					program.run(binfo);
+					if (cache != NULL && !replay) cache->store(*binfo.state, batch);
+				}
+			});
+			sink->target->markModified();
+		}
+		/*图结构未变时只重新渲染包含受影响节点的Stage 中间纹理保留到下次compile*/
 		void work() throw(NoOutputNodeException) {
+			std::lock_guard<std::recursive_mutex> lock(render_mutex_);
+			render();
+		}
+		/*work的实现 调用者持有render_mutex_*/
+		void render() {
 			if (output == NULL) throw NoOutputNodeException();
-			RuntimeInformation rinfo;
 			cout << output->height << ' ' << output->width << endl;
-			tex = new Texture(output->height, output->width, RGBA);
-			for (int x = 0; x < output->width; ++x)
-				for (int y = 0; y < output->height; ++y) {
-					rinfo.uv0 = Vec2f((x + 0.5) / output->width, (y + 0.5) / output->height);
-					rinfo.screenPosition = Vec2i(x, y);
-					for (int i = 0; i < node_sequence_.size(); ++i) {
-						node_sequence_[i]->work(rinfo);
+			if (compiled_ && tex != NULL) {
+				std::set<Node*> affected;
+				std::vector<Node*> stack(dirty_.begin(), dirty_.end());
+				std::set<Node*>::iterator it;
+				while (!stack.empty()) {
+					Node* node = stack.back();
+					stack.pop_back();
+					if (!affected.insert(node).second) continue;
+					for (it = node->binded_set.begin(); it != node->binded_set.end(); it++)
+						stack.push_back(*it);
+				}
+				dirty_.clear();
+				for (int i = 0; i < stages_.size() && !isCancelled(); ++i) {
+					Stage* stage = stages_[i];
+					for (it = stage->members.begin(); it != stage->members.end(); it++)
+						if (affected.find(*it) != affected.end()) break;
+					if (it != stage->members.end()) renderStage(stage, &affected);
+				}
+			}
+			else {
+				prepare();
+				if (!isCancelled()) renderStage(stages_.back(), NULL);
+				dirty_.clear();
+				compiled_ = true;
+			}
+			/*中途取消的Stage只渲染了一部分 下次必须完整重新渲染*/
+			if (isCancelled()) compiled_ = false;
+		}
+		/*在后台线程渲染 返回的future得到输出的副本 由调用者delete 之后的渲染不会修改它
+		  新的请求会取消尚未完成的旧请求 旧请求在下一个tile处停止并以RenderCancelledException结束
+		  Pass析构前应等待所有future完成*/
+		std::future<Texture*> workAsync() {
+			CancellationToken token = std::make_shared<std::atomic<bool> >(false);
+			{
+				std::lock_guard<std::mutex> lock(token_mutex_);
+				if (latest_token_) *latest_token_ = true;
+				latest_token_ = token;
+			}
+			return std::async(std::launch::async, [this, token]() -> Texture* {
+				std::lock_guard<std::recursive_mutex> lock(render_mutex_);
+				if (*token) throw RenderCancelledException();
+				cancel_ = token.get();
+				try {
+					render();
+				}
+				catch (...) {
+					cancel_ = NULL;
+					throw;
+				}
+				cancel_ = NULL;
+				if (*token) throw RenderCancelledException();
+				return tex->copyWith(LINEAR, 0, EDGE_CONSTANT);
+			});
+		}
+		/*取消正在进行的异步渲染*/
+		void cancel() {
+			std::lock_guard<std::mutex> lock(token_mutex_);
+			if (latest_token_) *latest_token_ = true;
+		}
+		/*重新compile并分配输出 渲染除最后一个以外的所有Stage*/
+		void prepare() {
+			state_size_ = compile();
+			/*尺寸不变时重新取回的就是同一块纹理 getTexture()返回的指针保持有效*/
+			texture_pool_.release(tex);
+			tex = texture_pool_.acquire(output->height, output->width);
+			output->target = tex;
+			for (int i = 0; i + 1 < stages_.size() && !isCancelled(); ++i) {
+				Stage* stage = stages_[i];
+				stage->sink->target = texture_pool_.acquire(stage->sink->height, stage->sink->width, RGBA, stage->sink->format);
+				renderStage(stage, NULL);
+			}
+		}
+		/*渐进式渲染 依次以1/8 1/4 1/2和全分辨率采样 每层结束后回调(tex, step)
+		  较粗层级已计算的采样点在之后的层级中直接保留 只计算新增的点 再把每个点扩展为step*step的块
+		  中间纹理仍以全分辨率渲染*/
+		void workProgressive(std::function<void(Texture*, int)> callback) throw(NoOutputNodeException) {
+			std::lock_guard<std::recursive_mutex> lock(render_mutex_);
+			if (output == NULL) throw NoOutputNodeException();
+			prepare();
+			Stage* stage = stages_.back();
+			ThreadPool& pool = ThreadPool::global();
+			std::vector<ExecutionState> states(pool.concurrency(), evaluateUniforms(stage));
+			int width = output->width, height = output->height;
+			for (int step = PROGRESSIVE_STEP; step >= 1; step /= 2) {
+				int rows = (height + step - 1) / step;
+				pool.parallelFor(rows, [&](int row, int worker) {
+					BatchInformation binfo;
+					binfo.state = &states[worker];
+					binfo.width = width;
+					binfo.height = height;
+					binfo.y = row * step;
+					/*偶数行的偶数列在上一层已经算过*/
+					bool reuse = step < PROGRESSIVE_STEP && row % 2 == 0;
+					binfo.stride = reuse ? step * 2 : step;
+					for (int x = reuse ? step : 0; x < width; x += BATCH_SIZE * binfo.stride) {
+						binfo.x0 = x;
+						binfo.count = std::min(BATCH_SIZE, (width - x + binfo.stride - 1) / binfo.stride);
+						stage->program.run(binfo);
+					}
+					if (step > 1) fillBlocks(binfo.y, step);
+				});
+				callback(tex, step);
+			}
+			dirty_.clear();
+			compiled_ = true;
+		}
+		/*只渲染从(x0, y0)开始w*h的区域 不使用融合内核与增量缓存*/
+		void renderRegion(Stage* stage, int x0, int y0, int w, int h) {
+			Node_Output* sink = stage->sink;
+			int tiles_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+			int tiles_y = (h + TILE_SIZE - 1) / TILE_SIZE;
+			ThreadPool& pool = ThreadPool::global();
+			std::vector<ExecutionState> states(pool.concurrency(), evaluateUniforms(stage));
+			pool.parallelFor(tiles_x * tiles_y, [&](int tile, int worker) {
+				if (isCancelled()) return;
+				BatchInformation binfo;
+				binfo.state = &states[worker];
+				binfo.width = sink->width;
+				binfo.height = sink->height;
+				binfo.x0 = x0 + tile % tiles_x * TILE_SIZE;
+				binfo.count = std::min(TILE_SIZE, x0 + w - binfo.x0);
+				int ty0 = y0 + tile / tiles_x * TILE_SIZE;
+				int ty1 = std::min(ty0 + TILE_SIZE, y0 + h);
+				for (binfo.y = ty0; binfo.y < ty1; ++binfo.y)
+					stage->program.run(binfo);
+			});
+		}
+		/*流式渲染 sources把Node_Texture的名字映射到分块源文件(TiledFile) 结果直接写入分块文件output_path
+		  每次只在内存中保留一个STREAM_TILE_SIZE大小的输出块和对应的源窗口 窗口向外扩展图中最大的采样半径
+		  峰值内存与图像大小无关 要求图中没有中间纹理 且采样位置不由UV输入决定 源文件读取或输出写入失败时抛出TiledFileException*/
+		void workStreaming(const std::map<std::string, std::string>& sources, const std::string& output_path)
+			throw(NoOutputNodeException, StreamingNotSupportedException, TiledFileException) {
+			std::lock_guard<std::recursive_mutex> lock(render_mutex_);
+			if (output == NULL) throw NoOutputNodeException();
+			std::set<Node*> streamed;
+			std::map<std::string, std::string>::const_iterator source;
+			for (source = sources.begin(); source != sources.end(); source++)
+				if (getNode<Node_Texture>(source->first) != NULL) streamed.insert(getNode<Node>(source->first));
+			state_size_ = compile(&streamed);
+			compiled_ = false; /*输出没有完整地保存在内存中 之后的work需要重新渲染*/
+			if (stages_.size() != 1) throw StreamingNotSupportedException("Render textures need the whole image in memory");
+			int radius = 0;
+			bool needs_average = false;
+			for (int i = 0; i < node_sequence_.size(); ++i) {
+				int r = node_sequence_[i]->sampleRadius();
+				if (r < 0) throw StreamingNotSupportedException("Sampling position depends on a UV input");
+				Node_Sample_Texture* sample = dynamic_cast<Node_Sample_Texture*>(node_sequence_[i]);
+				if (sample != NULL && sample->getMode() != SAMPLE_NEAREST)
+					throw StreamingNotSupportedException("Filtered sampling needs mip levels of the whole image");
+				radius = std::max(radius, r);
+				if (dynamic_cast<Node_AdjustContrast*>(node_sequence_[i]) != NULL) needs_average = true;
+				Node_Texture* texture = dynamic_cast<Node_Texture*>(node_sequence_[i]);
+				if (texture != NULL && texture->getBorder() == EDGE_WRAP)
+					throw StreamingNotSupportedException("Wrapped borders read the opposite side of the image");
+			}
+
+			std::vector<Node_Texture*> nodes;
+			std::vector<Texture*> originals;
+			std::vector<TiledFile*> files;
+			std::vector<Vec4f> averages;
+			TiledFile* out = NULL;
+			auto release = [&]() {
+				for (int i = 0; i < nodes.size(); ++i) {
+					if (nodes[i]->tex != originals[i]) delete nodes[i]->tex;
+					nodes[i]->tex = originals[i];
+				}
+				for (int i = 0; i < files.size(); ++i)
+					delete files[i];
+				delete out;
+				output->target = tex;
+			};
+			/*任何一步失败都先恢复Node_Texture并关闭文件再抛出*/
+			try {
+				std::map<std::string, std::string>::const_iterator it;
+				for (it = sources.begin(); it != sources.end(); it++) {
+					Node_Texture* node = getNode<Node_Texture>(it->first);
+					TiledFile* file = TiledFile::open(it->second);
+					if (node == NULL || file == NULL) {
+						delete file;
+						throw StreamingNotSupportedException("Cannot open " + it->second + " for " + it->first);
 					}
-					tex->set(x, y, output->c);
+					nodes.push_back(node);
+					originals.push_back(node->tex);
+					files.push_back(file);
+					averages.push_back(needs_average ? file->averageRGB() : Vec4f(0, 0, 0, 0));
 				}
+				out = TiledFile::create(output_path, output->width, output->height, RGBA);
+				if (out == NULL) throw StreamingNotSupportedException("Cannot create " + output_path);
+
+				Stage* stage = stages_.back();
+				int width = output->width, height = output->height;
+				for (int y0 = 0; y0 < height && !isCancelled(); y0 += STREAM_TILE_SIZE)
+					for (int x0 = 0; x0 < width && !isCancelled(); x0 += STREAM_TILE_SIZE) {
+						int w = std::min(STREAM_TILE_SIZE, width - x0);
+						int h = std::min(STREAM_TILE_SIZE, height - y0);
+						/*输出块按比例映射到源图像 再向外扩展采样半径 多出的1像素吸收取整误差*/
+						for (int i = 0; i < files.size(); ++i) {
+							long long sw = files[i]->getWidth(), sh = files[i]->getHeight();
+							int sx0 = (int)std::max(0LL, x0 * sw / width - radius - 1);
+							int sy0 = (int)std::max(0LL, y0 * sh / height - radius - 1);
+							int sx1 = (int)std::min(sw, ((x0 + w) * sw + width - 1) / width + radius + 1);
+							int sy1 = (int)std::min(sh, ((y0 + h) * sh + height - 1) / height + radius + 1);
+							int bpp = files[i]->getBytespp();
+							if (nodes[i]->tex != originals[i]) delete nodes[i]->tex;
+							/*先交给节点 读取失败时由release释放*/
+							Texture* window = nodes[i]->tex = new Texture((int)sh, (int)sw, bpp, sx0, sy0, sx1 - sx0, sy1 - sy0);
+							files[i]->readRegion(sx0, sy0, sx1 - sx0, sy1 - sy0, window->getData(), window->getStride());
+							window->setAverageRGB(averages[i]);
+							window->setBorder(nodes[i]->getBorder());
+						}
+						Texture target(height, width, RGBA, x0, y0, w, h);
+						output->target = &target;
+						renderRegion(stage, x0, y0, w, h);
+						out->writeRegion(x0, y0, w, h, target.getData(), target.getStride());
+					}
+			}
+			catch (...) {
+				release();
+				throw;
+			}
+			release();
+		}
+		/*把第y行上每隔step的采样点扩展为step*step的块*/
+		void fillBlocks(int y, int step) {
+			int width = output->width;
+			unsigned char* row = tex->getRow(y);
+			for (int x = 0; x < width; x += step) {
+				unsigned char* p = row + x * RGBA;
+				for (int i = 1; i < step && x + i < width; ++i)
+					memcpy(p + i * RGBA, p, RGBA);
+			}
+			for (int i = 1; i < step && y + i < output->height; ++i)
+				memcpy(tex->getRow(y + i), row, width * RGBA);
 		}
+		/*输出纹理归Pass所有 在Pass析构或输出尺寸改变后的下一次渲染时回收*/
 		inline Texture* getTexture() { return tex; }
+		inline TexturePool& getTexturePool() { return texture_pool_; }
 
 		
 		bool isValid() {
-			if (node_map_.size() == node_sequence_.size()) return true;
+			if (node_map_.size() == node_sequence_.size() + pruned_count_ + merged_count_) return true;
 			else return false;
 		}
 
@@ -5,103 +5,308 @@
 
 #include <map>
 #include <string>
+#include <sstream>
+#include <vector>
+#include <string.h>
+#include "vec.h"
 
-template <typename T> class OutputPort {
+const int BATCH_SIZE = 64;
+
+template <typename T> struct Lanes {
+	T lane[BATCH_SIZE];
+	inline T get(int i) {
+		return lane[i];
+	}
+	inline void set(int i, const T& value) {
+		lane[i] = value;
+	}
+};
+
+template <> struct Lanes<PhotoGraph::Vec4f> {
+	float r[BATCH_SIZE];
+	float g[BATCH_SIZE];
+	float b[BATCH_SIZE];
+	float a[BATCH_SIZE];
+	inline PhotoGraph::Vec4f get(int i) {
+		return PhotoGraph::Vec4f(r[i], g[i], b[i], a[i]);
+	}
+	inline void set(int i, const PhotoGraph::Vec4f& value) {
+		r[i] = value.r; g[i] = value.g; b[i] = value.b; a[i] = value.a;
+	}
+};
+
+template <> struct Lanes<PhotoGraph::Vec2f> {
+	float u[BATCH_SIZE];
+	float v[BATCH_SIZE];
+	inline PhotoGraph::Vec2f get(int i) {
+		return PhotoGraph::Vec2f(u[i], v[i]);
+	}
+	inline void set(int i, const PhotoGraph::Vec2f& value) {
+		u[i] = value.u; v[i] = value.v;
+	}
+};
+
+const size_t SLOT_ALIGN = 64;
+const size_t NULL_SLOT = 0;
+const size_t NULL_SLOT_SIZE = sizeof(Lanes<PhotoGraph::Matrix4x4>);
+
+class ExecutionState {
 private:
-	T value;
+	std::vector<unsigned char> buffer_;
+	unsigned char* values_;
+	size_t size_;
+	void allocate(size_t size) {
+		size_ = size;
+		buffer_.assign(size + SLOT_ALIGN, 0);
+		values_ = buffer_.data() + (SLOT_ALIGN - (size_t)buffer_.data() % SLOT_ALIGN) % SLOT_ALIGN;
+	}
+public:
+	ExecutionState(size_t size = 0) {
+		allocate(size);
+	}
+	ExecutionState(const ExecutionState& other) {
+		allocate(other.size_);
+		memcpy(values_, other.values_, size_);
+	}
+	ExecutionState& operator = (const ExecutionState& other) {
+		if (this != &other) {
+			allocate(other.size_);
+			memcpy(values_, other.values_, size_);
+		}
+		return *this;
+	}
+	inline void resize(size_t size) {
+		allocate(size);
+	}
+	inline size_t size() {
+		return size_;
+	}
+	template <typename T>
+	inline T& at(size_t slot) {
+		return *(T*)(values_ + slot);
+	}
+};
+
+template <typename T>
+void broadcastLanes(void* lanes) {
+	Lanes<T>& l = *(Lanes<T>*)lanes;
+	T value = l.get(0);
+	for (int i = 1; i < BATCH_SIZE; ++i)
+		l.set(i, value);
+}
+
+class OutputPortBase {
+protected:
+	size_t slot;
+	size_t bytes;
+	void (*broadcaster)(void*);
 public:
-	OutputPort() { 
-		value = T();
+	OutputPortBase(size_t bytes, void (*broadcaster)(void*)) : slot(0), bytes(bytes), broadcaster(broadcaster) {}
+	virtual ~OutputPortBase() {}
+	inline void broadcast(ExecutionState* state) {
+		broadcaster(&state->at<unsigned char>(slot));
 	}
-	inline void setValue(T value) {
-		this->value = value;
+	inline size_t getSlot() {
+		return slot;
 	}
-	inline T getValue() {
-		return this->value;
+	inline size_t layout(size_t offset) {
+		slot = offset;
+		return offset + (bytes + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN;
 	}
 };
 
-template <typename T> class InputPort {
-private:
-	OutputPort<T>* output;
+template <typename T> class OutputPort : public OutputPortBase {
 public:
-	InputPort() {
-		output = NULL; 
+	OutputPort() : OutputPortBase(sizeof(Lanes<T>), &broadcastLanes<T>) {}
+	inline void setValue(ExecutionState* state, int lane, T value) {
+		state->at<Lanes<T> >(slot).set(lane, value);
+	}
+	inline T getValue(ExecutionState* state, int lane) {
+		return state->at<Lanes<T> >(slot).get(lane);
 	}
-	inline bool isBinded() { 
-		return output != NULL; 
+	inline Lanes<T>& getLanes(ExecutionState* state) {
+		return state->at<Lanes<T> >(slot);
+	}
+};
+
+class InputPortBase {
+protected:
+	OutputPortBase* output;
+	size_t slot;
+public:
+	InputPortBase() {
+		output = NULL;
+		slot = NULL_SLOT;
 	}
-	inline void bind(OutputPort<T>* port) {
+	virtual ~InputPortBase() {}
+	inline bool isBinded() {
+		return output != NULL;
+	}
+	inline size_t getSlot() {
+		return slot;
+	}
+	inline OutputPortBase* getOutput() {
+		return output;
+	}
+	inline void bind(OutputPortBase* port) {
 		this->output = port;
 	}
-	inline T getValue() {
-		return this->output->getValue();
+	inline void resolve() {
+		slot = output != NULL ? output->getSlot() : NULL_SLOT;
 	}
 };
 
+template <typename T> class InputPort : public InputPortBase {
+public:
+	inline T getValue(ExecutionState* state, int lane) {
+		return state->at<Lanes<T> >(slot).get(lane);
+	}
+	inline Lanes<T>& getLanes(ExecutionState* state) {
+		return state->at<Lanes<T> >(slot);
+	}
+};
+
+class OutputPortMap;
+
+/*输入端口与其原先绑定的输出端口 用于撤销rebind*/
+typedef std::vector<std::pair<InputPortBase*, OutputPortBase*> > PortBindings;
+
 class InputPortMap {
 private:
-	std::map<std::string, size_t> ip_map_;
+	std::map<std::string, InputPortBase*> ip_map_;
 public:
+	InputPortBase* getPort(std::string port_name);
 	template <typename T>
 	InputPort<T>* getInputPort(std::string port_name);
 	template <typename T>
-	T getInput(std::string port_name);
+	T getInput(ExecutionState* state, int lane, std::string port_name);
 	template <typename T>
 	InputPort<T>* defineInputPort(std::string port_name);
+	void resolve();
+	std::string describeBindings();
+	void rebind(OutputPortMap& from, OutputPortMap& to, PortBindings* undo = NULL);
+	bool bindsTo(OutputPortMap& from);
 };
 
 class OutputPortMap {
 private:
-	std::map<std::string, size_t> op_map_;
+	std::map<std::string, OutputPortBase*> op_map_;
 public:
+	OutputPortBase* getPort(std::string port_name);
 	template <typename T>
 	OutputPort<T>* getOutputPort(std::string port_name);
 	template <typename T>
-	void setOutput(std::string port_name, T value);
+	void setOutput(ExecutionState* state, int lane, std::string port_name, T value);
 	template <typename T>
 	OutputPort<T>* defineOutputPort(std::string port_name);
+	size_t layout(size_t offset);
+	void broadcast(ExecutionState* state);
+	std::string findName(OutputPortBase* port);
 };
 
+inline InputPortBase* InputPortMap::getPort(std::string port_name) {
+	std::map<std::string, InputPortBase*>::iterator it = ip_map_.find(port_name);
+	if (it != ip_map_.end())
+		return it->second;
+	else return NULL;
+}
+
 template <typename T>
 InputPort<T>* InputPortMap::getInputPort(std::string port_name) {
-	if (ip_map_.find(port_name) != ip_map_.end())
-		return (InputPort<T>*)ip_map_[port_name];
-	else return NULL;
+	return (InputPort<T>*)getPort(port_name);
 }
 
 template <typename T>
-T InputPortMap::getInput(std::string port_name) {
-	if (ip_map_.find(port_name) != ip_map_.end())
-		return ((InputPort<T>*)ip_map_[port_name])->getValue();
+T InputPortMap::getInput(ExecutionState* state, int lane, std::string port_name) {
+	InputPortBase* port = getPort(port_name);
+	if (port != NULL)
+		return ((InputPort<T>*)port)->getValue(state, lane);
 	else return T();
 }
 
 template <typename T>
 InputPort<T>* InputPortMap::defineInputPort(std::string port_name) {
 	InputPort<T>* obj = new InputPort<T>();
-	ip_map_[port_name] = (size_t)(obj);
+	ip_map_[port_name] = obj;
 	return obj;
 }
 
+inline void InputPortMap::resolve() {
+	std::map<std::string, InputPortBase*>::iterator it;
+	for (it = ip_map_.begin(); it != ip_map_.end(); it++)
+		it->second->resolve();
+}
+
+inline std::string InputPortMap::describeBindings() {
+	std::ostringstream desc;
+	std::map<std::string, InputPortBase*>::iterator it;
+	for (it = ip_map_.begin(); it != ip_map_.end(); it++)
+		desc << it->first << "=" << (void*)it->second->getOutput() << ";";
+	return desc.str();
+}
+
+inline OutputPortBase* OutputPortMap::getPort(std::string port_name) {
+	std::map<std::string, OutputPortBase*>::iterator it = op_map_.find(port_name);
+	if (it != op_map_.end())
+		return it->second;
+	else return NULL;
+}
+
 template <typename T>
 OutputPort<T>* OutputPortMap::getOutputPort(std::string port_name) {
-	if (op_map_.find(port_name) != op_map_.end())
-		return (OutputPort<T>*)op_map_[port_name];
-	else return NULL;
+	return (OutputPort<T>*)getPort(port_name);
 }
 
 template <typename T>
-void OutputPortMap::setOutput(std::string port_name, T value) {
-	if (op_map_.find(port_name) != op_map_.end())
-		((OutputPort<T>*)op_map_[port_name])->setValue(value);
+void OutputPortMap::setOutput(ExecutionState* state, int lane, std::string port_name, T value) {
+	OutputPortBase* port = getPort(port_name);
+	if (port != NULL)
+		((OutputPort<T>*)port)->setValue(state, lane, value);
 }
 
 template <typename T>
 OutputPort<T>* OutputPortMap::defineOutputPort(std::string port_name) {
 	OutputPort<T>* obj = new OutputPort<T>();
-	op_map_[port_name] = (size_t)(obj);
+	op_map_[port_name] = obj;
 	return obj;
 }
 
+inline size_t OutputPortMap::layout(size_t offset) {
+	std::map<std::string, OutputPortBase*>::iterator it;
+	for (it = op_map_.begin(); it != op_map_.end(); it++)
+		offset = it->second->layout(offset);
+	return offset;
+}
+
+inline void OutputPortMap::broadcast(ExecutionState* state) {
+	std::map<std::string, OutputPortBase*>::iterator it;
+	for (it = op_map_.begin(); it != op_map_.end(); it++)
+		it->second->broadcast(state);
+}
+
+inline std::string OutputPortMap::findName(OutputPortBase* port) {
+	std::map<std::string, OutputPortBase*>::iterator it;
+	for (it = op_map_.begin(); it != op_map_.end(); it++)
+		if (it->second == port) return it->first;
+	return std::string();
+}
+
+inline void InputPortMap::rebind(OutputPortMap& from, OutputPortMap& to, PortBindings* undo) {
+	std::map<std::string, InputPortBase*>::iterator it;
+	for (it = ip_map_.begin(); it != ip_map_.end(); it++) {
+		if (it->second->getOutput() == NULL) continue;
+		std::string name = from.findName(it->second->getOutput());
+		if (name.empty()) continue;
+		if (undo != NULL) undo->push_back(std::make_pair(it->second, it->second->getOutput()));
+		it->second->bind(to.getPort(name));
+	}
+}
+
+inline bool InputPortMap::bindsTo(OutputPortMap& from) {
+	std::map<std::string, InputPortBase*>::iterator it;
+	for (it = ip_map_.begin(); it != ip_map_.end(); it++)
+		if (it->second->getOutput() != NULL && !from.findName(it->second->getOutput()).empty()) return true;
+	return false;
+}
+
 #endif
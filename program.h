@@ -0,0 +1,77 @@
+#pragma once
+
+#ifndef _PROGRAM_H
+#define _PROGRAM_H
+
+#include "node.h"
+#include <vector>
+
+namespace PhotoGraph {
+	/*把排好序的节点编译成指令序列 以batch为单位解释执行*/
+	class Program {
+	private:
+		std::vector<Instruction> code_;
+
+		template <typename T>
+		static inline Lanes<T>& reg(ExecutionState& state, size_t slot) {
+			return state.at<Lanes<T> >(slot);
+		}
+		template <typename T>
+		static inline Lanes<T>* optionalReg(ExecutionState& state, size_t slot) {
+			return slot != NULL_SLOT ? &state.at<Lanes<T> >(slot) : NULL;
+		}
+	public:
+		void compile(const std::vector<Node*>& sequence) {
+			code_.clear();
+			for (int i = 0; i < sequence.size(); ++i) {
+				Instruction ins;
+				ins.node = sequence[i];
+				if (!ins.node->lower(ins)) ins.op = OP_NODE;
+				code_.push_back(ins);
+			}
+		}
+		inline size_t size() { return code_.size(); }
+
+		void run(const BatchInformation& binfo) {
+			ExecutionState& st = *binfo.state;
+			const Instruction* ins = code_.data();
+			const Instruction* end = ins + code_.size();
+			for (; ins != end; ++ins) {
+				switch (ins->op) {
+				case OP_TEXTURE:
+					Node_Texture::kernel(((Node_Texture*)ins->node)->view, reg<Texture*>(st, ins->dst), binfo.count);
+					break;
+				case OP_SAMPLE:
+					Node_Sample_Texture::kernel(reg<Texture*>(st, ins->src[0]), optionalReg<Vec2f>(st, ins->src[1]), reg<Vec4f>(st, ins->dst), binfo, (SampleMode)(int)ins->imm[0]);
+					break;
+				case OP_INVERSE:
+					Node_Inverse::kernel(reg<Vec4f>(st, ins->src[0]), reg<Vec4f>(st, ins->dst), binfo.count);
+					break;
+				case OP_SATURATION:
+					Node_Saturation::kernel(reg<Vec4f>(st, ins->src[0]), reg<Vec4f>(st, ins->dst), binfo.count, ins->imm[0]);
+					break;
+				case OP_GRAY:
+					Node_RGB2Grayscale::kernel(reg<Vec4f>(st, ins->src[0]), reg<float>(st, ins->dst), binfo.count);
+					break;
+				case OP_GRAY2RGB:
+					Node_Gray2RGB::kernel(reg<float>(st, ins->src[0]), reg<Vec4f>(st, ins->dst), binfo.count);
+					break;
+				case OP_BINARIZE:
+					Node_Binarization::kernel(reg<float>(st, ins->src[0]), reg<float>(st, ins->dst), binfo.count, ins->imm[0]);
+					break;
+				case OP_MOVE:
+					Node_Move::kernel(optionalReg<Vec2f>(st, ins->src[0]), reg<Vec2f>(st, ins->dst), binfo, ins->imm[0], ins->imm[1]);
+					break;
+				case OP_OUTPUT:
+					Node_Output::kernel(reg<Vec4f>(st, ins->src[0]), ((Node_Output*)ins->node)->target, binfo);
+					break;
+				default:
+					ins->node->workBatch(binfo);
+					break;
+				}
+			}
+		}
+	};
+}
+
+#endif
@@ -1,8 +1,25 @@
 #ifndef _TEXTURE_H
 #define _TEXTURE_H
 
+#include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include <opencv2/opencv.hpp>
+#include "vec.h"
+#include "thread_pool.h"
+#include "mapped_file.h"
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define PHOTOGRAPH_SSE2
+#endif
 using namespace cv;
 
 namespace PhotoGraph {
@@ -12,6 +29,92 @@ namespace PhotoGraph {
 		RGBA = 4
 	};
 
+	/*每个通道的存储格式 浮点纹理与8位纹理使用相同的0-255数值范围 但不截断 不量化*/
+	enum PixelType {
+		PIXEL_8U,
+		PIXEL_16F,
+		PIXEL_32F
+	};
+
+	/*IEEE 754半精度与单精度互相转换 舍入到最近的偶数*/
+	static inline float halfToFloat(unsigned short h) {
+		unsigned int sign = (h & 0x8000u) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff, bits;
+		if (exp == 0 && mant == 0) bits = sign;
+		else if (exp == 0) {
+			/*非规格化数*/
+			exp = 127 - 15 + 1;
+			while (!(mant & 0x400)) {
+				mant <<= 1;
+				exp--;
+			}
+			bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+		}
+		else if (exp == 31) bits = sign | 0x7f800000u | (mant << 13);
+		else bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		return f;
+	}
+	static inline unsigned short floatToHalf(float f) {
+		unsigned int bits;
+		memcpy(&bits, &f, sizeof(bits));
+		unsigned int sign = (bits >> 16) & 0x8000u, mant = bits & 0x7fffff;
+		int exp = (int)((bits >> 23) & 0xff) - 127 + 15;
+		if (((bits >> 23) & 0xff) == 0xff) return (unsigned short)(sign | 0x7c00 | (mant ? 0x200 : 0));
+		if (exp >= 31) return (unsigned short)(sign | 0x7c00);
+		unsigned int half, rem, mid;
+		if (exp <= 0) {
+			if (exp < -10) return (unsigned short)sign;
+			mant |= 0x800000;
+			int shift = 14 - exp;
+			half = mant >> shift;
+			rem = mant & ((1u << shift) - 1);
+			mid = 1u << (shift - 1);
+		}
+		else {
+			half = (exp << 10) | (mant >> 13);
+			rem = mant & 0x1fff;
+			mid = 0x1000;
+		}
+		/*进位可以溢出到指数位 结果仍然正确*/
+		if (rem > mid || (rem == mid && (half & 1))) half++;
+		return (unsigned short)(sign | half);
+	}
+
+	/*LINEAR按行存放 BLOCKED按8*8像素的块存放 块内按行 块之间按行
+	  邻域采样的一列像素落在同一块内 不必每行都访问新的缓存行
+	  PLANAR每个通道单独一个平面 平面内按行 同一通道相邻的像素连续存放 可以一次处理多个像素*/
+	enum Layout {
+		LINEAR,
+		BLOCKED,
+		PLANAR
+	};
+	const int BLOCK_SHIFT = 3;
+	const int PLANE_ALIGN = 16; /*PLANAR布局每行的字节数补齐到此倍数*/
+
+	/*按通道处理PLANAR纹理邻域时的运算*/
+	enum WindowOp {
+		WINDOW_MAX,
+		WINDOW_MIN,
+		WINDOW_MEAN
+	};
+
+	/*纹理之外的像素 CLAMP取最近的边缘 MIRROR以边缘为轴镜像 WRAP从另一侧重复 CONSTANT取固定颜色(默认为0)*/
+	enum BorderPolicy {
+		EDGE_CONSTANT,
+		EDGE_CLAMP,
+		EDGE_MIRROR,
+		EDGE_WRAP
+	};
+
+	/*NEAREST在原分辨率取最近的像素 BILINEAR在最接近的mip层级双线性插值 TRILINEAR再在相邻两层之间插值*/
+	enum SampleMode {
+		SAMPLE_NEAREST,
+		SAMPLE_BILINEAR,
+		SAMPLE_TRILINEAR
+	};
+
+	/*打包为4字节 通道数由所在的纹理决定 不存在的通道为0*/
 	struct Color {
 		union {
 			struct {
@@ -20,103 +123,935 @@ namespace PhotoGraph {
 			unsigned char raw[4];
 			unsigned int val;
 		};
-		unsigned char bytespp;
 		unsigned char& operator [] (const int& idx) {
 			return raw[idx];
 		}
-		Color& operator * (float f) {
+		Color operator * (float f) const {
 			Color out;
-			for (int i = 0; i < bytespp; ++i)
-				out[i] = raw[i] * f;
+			for (int i = 0; i < 4; ++i)
+				out.raw[i] = (unsigned char)(raw[i] * f);
 			return out;
 		}
-		Color& operator = (const Color& c) {
-			if (this != &c) {
-				val = c.val;
+		Color() : val(0) {}
+		Color(int _r, int _g, int _b) : val(0) {
+			r = _r;
+			g = _g;
+			b = _b;
+		}
+		Color(int _r, int _g, int _b, int _a) {
+			r = _r;
+			g = _g;
+			b = _b;
+			a = _a;
+		}
+		/*从交错存放的bpp个字节读取 4通道时一次读取*/
+		Color(const unsigned char* p, unsigned char bpp) : val(0) {
+			if (bpp == RGBA) memcpy(&val, p, 4);
+			else if (bpp == RGB) {
+				raw[0] = p[0];
+				raw[1] = p[1];
+				raw[2] = p[2];
 			}
-			return *this;
+			else raw[0] = p[0];
 		}
-		Color() : val(0), bytespp(1) {}
-		Color(int _r, int _g, int _b) : r(_r), g(_g), b(_b), bytespp(3) {}
-		Color(int _r, int _g, int _b, int _a) : r(_r), g(_g), b(_b), a(_a), bytespp(4) {}
-		Color(int v, unsigned char bpp) : val(v), bytespp(bpp) {}
-		Color(unsigned char* p, unsigned char bpp) : bytespp(bpp) {
-			for (int i = 0;i < bpp;++i)
-				raw[i] = p[i];
+	};
+	static_assert(sizeof(Color) == 4, "Color must stay packed");
+
+	/*窗口内像素各通道的统计量 不存在的通道为0
+	  直方图按0-255分为256格 浮点值截断到该范围后计入*/
+	struct TextureStatistics {
+		Vec4f mean;
+		Vec4f minimum;
+		Vec4f maximum;
+		size_t histogram[4][256];
+		size_t count;
+		TextureStatistics() : count(0) {
+			memset(histogram, 0, sizeof(histogram));
+		}
+		/*第channel通道的p分位数 p在[0, 1]之间 精度为直方图的一格*/
+		float percentile(int channel, float p) const {
+			if (count == 0) return 0;
+			size_t rank = (size_t)std::max(1.0, ceil((double)p * count)), seen = 0;
+			for (int i = 0; i < 256; ++i) {
+				seen += histogram[channel][i];
+				if (seen >= rank) return (float)i;
+			}
+			return 255;
 		}
 	};
 
+	/*原始纹理缓存文件的头部 其后从data_offset开始按行存放像素 可以直接映射使用*/
+	struct RawTextureHeader {
+		char magic[4]; /*"PGRT"*/
+		int version;
+		int width;
+		int height;
+		int bytespp;
+		int type; /*PixelType*/
+		long long stride;
+		long long data_offset; /*按页对齐 映射后每行的地址与内存中分配的纹理一样对齐*/
+		long long source_mtime; /*生成时原图的修改时间 不一致说明缓存已过期*/
+		long long count;
+		float mean[4];
+		float minimum[4];
+		float maximum[4];
+		unsigned long long histogram[4][256];
+	};
+	const int RAW_TEXTURE_VERSION = 1;
+	const long long RAW_TEXTURE_ALIGN = 4096;
+
 	class Texture {
 	private:	
 		unsigned char* data;
 		int pixelHeight;
 		int pixelWidth;
 		unsigned char bytespp;
-		Vec4f averageRGB;
+		Vec4f averageRGB; /*由setAverageRGB指定 否则取statistics().mean*/
+		bool averageFixed;
+		TextureStatistics stats_;
+		std::atomic<bool> stats_valid_;
+		std::mutex stats_mutex_;
+		/*data只保存整幅图像中的一个窗口 窗口之外按图像之外处理 默认窗口即整幅图像*/
+		int windowX, windowY, windowWidth, windowHeight;
+		size_t stride; /*每行字节数 包装外部缓冲区时可能大于windowWidth*bytespp*/
+		bool ownsData; /*data由本对象new[]分配*/
+		Mat owner; /*包装cv::Mat时持有其引用计数*/
+		std::shared_ptr<MappedFile> mapping; /*由openRaw创建时data指向映射的文件*/
+		Layout layout;
+		int blocksX; /*BLOCKED布局每一行的块数*/
+		size_t channelStep; /*同一像素相邻两个通道之间的字节数 PLANAR布局下为一个平面的大小*/
+		std::vector<Texture*> mips_; /*mips_[i]为第i+1层 每层宽高减半 第一次需要时生成*/
+		std::atomic<bool> mips_valid_;
+		std::mutex mips_mutex_;
+		int apron; /*四周额外分配并按border填好的像素宽度 邻域完全落在其中时不必检查边界*/
+		BorderPolicy border;
+		Color borderColor;
+		PixelType type;
+		int pixelBytes; /*每像素字节数 8位格式下等于bytespp(通道数)*/
+		Texture(const Texture&);
+		Texture& operator = (const Texture&);
+
+		void wrap(const Mat& mat) {
+			owner = mat;
+			data = owner.data;
+			pixelHeight = windowHeight = owner.rows;
+			pixelWidth = windowWidth = owner.cols;
+			windowX = windowY = 0;
+			bytespp = owner.channels();
+			type = owner.depth() == CV_32F ? PIXEL_32F : owner.depth() == CV_16F ? PIXEL_16F : PIXEL_8U;
+			pixelBytes = bytespp * (type == PIXEL_32F ? 4 : type == PIXEL_16F ? 2 : 1);
+			stride = owner.step;
+			ownsData = false;
+			layout = LINEAR;
+			blocksX = 0;
+			channelStep = pixelBytes / bytespp;
+		}
+		/*每个像素取上一层对应的2*2个像素的平均值 直到1*1*/
+		void buildMips() {
+			for (int i = 0; i < mips_.size(); ++i)
+				delete mips_[i];
+			mips_.clear();
+			Texture* src = this;
+			while (src->pixelWidth > 1 || src->pixelHeight > 1) {
+				int w = std::max(1, src->pixelWidth / 2), h = std::max(1, src->pixelHeight / 2);
+				Texture* dst = new Texture(h, w, bytespp, LINEAR, 0, type);
+				for (int y = 0; y < h; ++y) {
+					int y0 = std::min(2 * y, src->pixelHeight - 1), y1 = std::min(2 * y + 1, src->pixelHeight - 1);
+					for (int x = 0; x < w; ++x) {
+						int x0 = std::min(2 * x, src->pixelWidth - 1), x1 = std::min(2 * x + 1, src->pixelWidth - 1);
+						unsigned char* p[4] = { src->data + src->offsetOf(x0, y0), src->data + src->offsetOf(x1, y0),
+							src->data + src->offsetOf(x0, y1), src->data + src->offsetOf(x1, y1) };
+						unsigned char* q = dst->data + dst->offsetOf(x, y);
+						if (type == PIXEL_8U) {
+							size_t step = src->channelStep;
+							for (int c = 0; c < bytespp; ++c)
+								q[c] = (p[0][c * step] + p[1][c * step] + p[2][c * step] + p[3][c * step] + 2) >> 2;
+							continue;
+						}
+						float v[4][4];
+						for (int k = 0; k < 4; ++k)
+							src->load(p[k], v[k]);
+						for (int c = 0; c < 4; ++c)
+							v[0][c] = (v[0][c] + v[1][c] + v[2][c] + v[3][c]) * 0.25f;
+						dst->store(q, v[0]);
+					}
+				}
+				mips_.push_back(dst);
+				src = dst;
+			}
+		}
+#ifdef PHOTOGRAPH_SSE2
+		/*8位纹理第y行前若干像素各通道的最值与和 每次处理16字节 返回处理过的像素数 其余由调用者逐像素处理
+		  只处理一行连续存放的情况 PLANAR或单通道逐通道处理 四通道LINEAR按通道掩码求和*/
+		int accumulateRow8(int y, int* mn, int* mx, unsigned long long* total) {
+			const __m128i zero = _mm_setzero_si128();
+			unsigned char lo_bytes[16], hi_bytes[16];
+			unsigned long long sums[2];
+			if (layout == PLANAR || (layout == LINEAR && bytespp == 1)) {
+				int n = windowWidth / 16 * 16;
+				for (int c = 0; c < bytespp; ++c) {
+					const unsigned char* row = data + offsetOf(0, y) + c * channelStep;
+					__m128i lo = _mm_set1_epi8(-1), hi = zero, acc = zero;
+					for (int x = 0; x < n; x += 16) {
+						__m128i v = _mm_loadu_si128((const __m128i*)(row + x));
+						lo = _mm_min_epu8(lo, v);
+						hi = _mm_max_epu8(hi, v);
+						acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+					}
+					_mm_storeu_si128((__m128i*)lo_bytes, lo);
+					_mm_storeu_si128((__m128i*)hi_bytes, hi);
+					_mm_storeu_si128((__m128i*)sums, acc);
+					for (int i = 0; i < 16; ++i) {
+						mn[c] = std::min(mn[c], (int)lo_bytes[i]);
+						mx[c] = std::max(mx[c], (int)hi_bytes[i]);
+					}
+					total[c] += sums[0] + sums[1];
+				}
+				return n;
+			}
+			if (layout == LINEAR && bytespp == RGBA) {
+				int n = windowWidth / 4 * 4;
+				const unsigned char* row = data + offsetOf(0, y);
+				__m128i lo = _mm_set1_epi8(-1), hi = zero, acc[4], mask[4];
+				for (int c = 0; c < 4; ++c) {
+					acc[c] = zero;
+					mask[c] = _mm_set1_epi32(0xff << (8 * c));
+				}
+				for (int x = 0; x < n; x += 4) {
+					__m128i v = _mm_loadu_si128((const __m128i*)(row + x * RGBA));
+					lo = _mm_min_epu8(lo, v);
+					hi = _mm_max_epu8(hi, v);
+					for (int c = 0; c < 4; ++c)
+						acc[c] = _mm_add_epi64(acc[c], _mm_sad_epu8(_mm_and_si128(v, mask[c]), zero));
+				}
+				_mm_storeu_si128((__m128i*)lo_bytes, lo);
+				_mm_storeu_si128((__m128i*)hi_bytes, hi);
+				for (int i = 0; i < 16; ++i) {
+					mn[i % 4] = std::min(mn[i % 4], (int)lo_bytes[i]);
+					mx[i % 4] = std::max(mx[i % 4], (int)hi_bytes[i]);
+				}
+				for (int c = 0; c < 4; ++c) {
+					_mm_storeu_si128((__m128i*)sums, acc[c]);
+					total[c] += sums[0] + sums[1];
+				}
+				return n;
+			}
+			return 0;
+		}
+#endif
+		/*累加第y行 8位纹理的最值与和尽量用SIMD求 直方图逐像素统计*/
+		void accumulateRow(int y, TextureStatistics& st, double* sum) {
+			if (type == PIXEL_8U) {
+				int mn[4] = { 255, 255, 255, 255 }, mx[4] = { 0, 0, 0, 0 };
+				unsigned long long total[4] = { 0, 0, 0, 0 };
+				int done = 0;
+#ifdef PHOTOGRAPH_SSE2
+				done = accumulateRow8(y, mn, mx, total);
+#endif
+				for (int x = 0; x < windowWidth; ++x) {
+					unsigned char* p = data + offsetOf(x, y);
+					for (int c = 0; c < bytespp; ++c) {
+						int v = p[c * channelStep];
+						st.histogram[c][v]++;
+						if (x < done) continue;
+						mn[c] = std::min(mn[c], v);
+						mx[c] = std::max(mx[c], v);
+						total[c] += v;
+					}
+				}
+				for (int c = 0; c < bytespp && windowWidth > 0; ++c) {
+					st.minimum[c] = std::min(st.minimum[c], (float)mn[c]);
+					st.maximum[c] = std::max(st.maximum[c], (float)mx[c]);
+					sum[c] += (double)total[c];
+				}
+				return;
+			}
+			float v[4];
+#ifdef PHOTOGRAPH_SSE2
+			__m128 lo = _mm_set1_ps(INFINITY), hi = _mm_set1_ps(-INFINITY), acc = _mm_setzero_ps();
+			for (int x = 0; x < windowWidth; ++x) {
+				load(data + offsetOf(x, y), v);
+				__m128 pv = _mm_loadu_ps(v);
+				lo = _mm_min_ps(lo, pv);
+				hi = _mm_max_ps(hi, pv);
+				acc = _mm_add_ps(acc, pv);
+				for (int c = 0; c < bytespp; ++c)
+					st.histogram[c][v[c] > 0 ? (int)std::min(v[c], 255.f) : 0]++;
+			}
+			float mn[4], mx[4], total[4];
+			_mm_storeu_ps(mn, lo);
+			_mm_storeu_ps(mx, hi);
+			_mm_storeu_ps(total, acc);
+#else
+			float mn[4] = { INFINITY, INFINITY, INFINITY, INFINITY }, mx[4] = { -INFINITY, -INFINITY, -INFINITY, -INFINITY }, total[4] = { 0, 0, 0, 0 };
+			for (int x = 0; x < windowWidth; ++x) {
+				load(data + offsetOf(x, y), v);
+				for (int c = 0; c < 4; ++c) {
+					mn[c] = std::min(mn[c], v[c]);
+					mx[c] = std::max(mx[c], v[c]);
+					total[c] += v[c];
+				}
+				for (int c = 0; c < bytespp; ++c)
+					st.histogram[c][v[c] > 0 ? (int)std::min(v[c], 255.f) : 0]++;
+			}
+#endif
+			for (int c = 0; c < 4; ++c) {
+				st.minimum[c] = std::min(st.minimum[c], mn[c]);
+				st.maximum[c] = std::max(st.maximum[c], mx[c]);
+				sum[c] += total[c];
+			}
+		}
+		/*按行分给线程池 每个线程累加到自己的部分结果中 最后合并*/
+		void computeStatistics() {
+			ThreadPool& pool = ThreadPool::global();
+			int workers = pool.concurrency();
+			std::vector<TextureStatistics> partial(workers);
+			std::vector<double> sums(workers * 4, 0.0);
+			for (int w = 0; w < workers; ++w)
+				for (int c = 0; c < 4; ++c) {
+					partial[w].minimum[c] = INFINITY;
+					partial[w].maximum[c] = -INFINITY;
+				}
+			pool.parallelFor(windowHeight, [&](int y, int worker) {
+				accumulateRow(y, partial[worker], &sums[worker * 4]);
+			});
+
+			stats_ = TextureStatistics();
+			stats_.count = (size_t)windowWidth * windowHeight;
+			double sum[4] = { 0, 0, 0, 0 };
+			for (int c = 0; c < 4; ++c) {
+				stats_.minimum[c] = INFINITY;
+				stats_.maximum[c] = -INFINITY;
+			}
+			for (int w = 0; w < workers; ++w)
+				for (int c = 0; c < 4; ++c) {
+					for (int i = 0; i < 256; ++i)
+						stats_.histogram[c][i] += partial[w].histogram[c][i];
+					stats_.minimum[c] = std::min(stats_.minimum[c], partial[w].minimum[c]);
+					stats_.maximum[c] = std::max(stats_.maximum[c], partial[w].maximum[c]);
+					sum[c] += sums[w * 4 + c];
+				}
+			for (int c = 0; c < 4; ++c) {
+				if (stats_.count == 0 || c >= bytespp) stats_.minimum[c] = stats_.maximum[c] = 0;
+				stats_.mean[c] = stats_.count > 0 ? (float)(sum[c] / stats_.count) : 0;
+			}
+		}
+		/*超出纹理的边缘像素取最近的边缘*/
+		inline unsigned int texel(int x, int y) {
+			x = std::min(std::max(x, 0), pixelWidth - 1);
+			y = std::min(std::max(y, 0), pixelHeight - 1);
+			return get(x, y).val;
+		}
+		/*窗口内(x, y)处像素的字节偏移 x y可以落在apron中*/
+		inline size_t offsetOf(int x, int y) {
+			x += apron;
+			y += apron;
+			if (layout == LINEAR) return y * stride + x * pixelBytes;
+			if (layout == PLANAR) return y * stride + x * (pixelBytes / bytespp);
+			const int mask = (1 << BLOCK_SHIFT) - 1;
+			size_t block = (size_t)(y >> BLOCK_SHIFT) * blocksX + (x >> BLOCK_SHIFT);
+			return ((((block << BLOCK_SHIFT) + (y & mask)) << BLOCK_SHIFT) + (x & mask)) * pixelBytes;
+		}
+		/*p处一个像素的各通道 不足4个通道时其余为0*/
+		inline void load(const unsigned char* p, float* out) {
+			for (int c = 0; c < 4; ++c)
+				out[c] = 0;
+			for (int c = 0; c < bytespp; ++c) {
+				const unsigned char* q = p + c * channelStep;
+				if (type == PIXEL_8U) out[c] = *q;
+				else if (type == PIXEL_16F) out[c] = halfToFloat(*(const unsigned short*)q);
+				else out[c] = *(const float*)q;
+			}
+		}
+		/*8位格式与Color一样直接截取低8位*/
+		inline void store(unsigned char* p, const float* v) {
+			for (int c = 0; c < bytespp; ++c) {
+				unsigned char* q = p + c * channelStep;
+				if (type == PIXEL_8U) *q = (unsigned char)(int)v[c];
+				else if (type == PIXEL_16F) *(unsigned short*)q = floatToHalf(v[c]);
+				else *(float*)q = v[c];
+			}
+		}
+		/*8位像素转为Color PLANAR布局从各平面分别读取*/
+		inline Color color8(const unsigned char* p) {
+			if (layout != PLANAR) return Color(p, bytespp);
+			Color c;
+			for (int i = 0; i < bytespp; ++i)
+				c.raw[i] = p[i * channelStep];
+			return c;
+		}
+		/*浮点像素截断到0-255后转为Color*/
+		inline Color toColor(const unsigned char* p) {
+			if (type == PIXEL_8U) return color8(p);
+			float v[4];
+			load(p, v);
+			Color c;
+			for (int i = 0; i < bytespp; ++i)
+				c.raw[i] = (unsigned char)std::min(std::max(v[i], 0.f), 255.f);
+			return c;
+		}
 
 	public:
-		Texture(int height = 1, int width = 1, int bytespp = 3) : pixelHeight(height), pixelWidth(width), bytespp(bytespp) {
+		Texture(int height = 1, int width = 1, int bytespp = 3) : pixelHeight(height), pixelWidth(width), bytespp(bytespp),
+			averageFixed(false), stats_valid_(false), windowX(0), windowY(0), windowWidth(width), windowHeight(height), stride((size_t)width * bytespp), ownsData(true), layout(LINEAR), blocksX(0), channelStep(1), mips_valid_(false), apron(0), border(EDGE_CONSTANT), type(PIXEL_8U), pixelBytes(bytespp) {
 			data = new unsigned char[height * width * bytespp];
 			memset(data, 0xff, height * width * bytespp * sizeof(unsigned char));
 		}
-		Texture(std::string filename) {
-			Mat out = imread(filename);
-			pixelHeight = out.rows;
-			pixelWidth = out.cols;
-			bytespp = out.channels();
-			data = new unsigned char[pixelHeight * pixelWidth * bytespp];
-			memcpy_s(data, pixelHeight * pixelWidth * bytespp, out.data, pixelHeight * pixelWidth * bytespp);
-			averageRGB = calculateAverageRGB();
+		/*height*width的图像中只分配从(x, y)开始w*h的窗口 内容由调用者填写*/
+		Texture(int height, int width, int bytespp, int x, int y, int w, int h) : pixelHeight(height), pixelWidth(width), bytespp(bytespp),
+			averageFixed(false), stats_valid_(false), windowX(x), windowY(y), windowWidth(w), windowHeight(h), stride((size_t)w * bytespp), ownsData(true), layout(LINEAR), blocksX(0), channelStep(1), mips_valid_(false), apron(0), border(EDGE_CONSTANT), type(PIXEL_8U), pixelBytes(bytespp) {
+			data = new unsigned char[w * h * bytespp];
+		}
+		/*指定布局 四周apron的宽度和通道格式 内容由调用者填写 BLOCKED布局的宽高补齐到整块
+		  PLANAR布局每个平面的行补齐到PLANE_ALIGN字节*/
+		Texture(int height, int width, int bytespp, Layout layout, int apron = 0, PixelType type = PIXEL_8U) : pixelHeight(height), pixelWidth(width), bytespp(bytespp),
+			averageFixed(false), stats_valid_(false), windowX(0), windowY(0), windowWidth(width), windowHeight(height), ownsData(true), layout(layout), mips_valid_(false), apron(apron), border(EDGE_CONSTANT),
+			type(type), pixelBytes(bytespp * (type == PIXEL_32F ? 4 : type == PIXEL_16F ? 2 : 1)) {
+			const int size = 1 << BLOCK_SHIFT;
+			int w = width + 2 * apron, h = height + 2 * apron;
+			blocksX = (w + size - 1) >> BLOCK_SHIFT;
+			int rows = layout == BLOCKED ? ((h + size - 1) >> BLOCK_SHIFT) << BLOCK_SHIFT : h;
+			stride = (size_t)(layout == BLOCKED ? blocksX << BLOCK_SHIFT : w) * pixelBytes;
+			channelStep = pixelBytes / bytespp;
+			if (layout == PLANAR) {
+				stride = ((size_t)w * channelStep + PLANE_ALIGN - 1) / PLANE_ALIGN * PLANE_ALIGN;
+				channelStep = rows * stride;
+				rows *= bytespp;
+			}
+			data = new unsigned char[rows * stride];
+		}
+		/*直接使用解码得到的Mat 不再复制一份 EXR 浮点TIFF与16位图像读为32位浮点 1.0(或65535)对应255*/
+		/*reduction为2 4 8时按该倍数缩小解码 JPEG在DCT阶段直接缩小 其他格式解码后缩小*/
+		Texture(std::string filename, int reduction = 1) : averageFixed(false), stats_valid_(false), mips_valid_(false), apron(0), border(EDGE_CONSTANT) {
+			int flags = IMREAD_COLOR;
+			if (reduction == 2) flags = IMREAD_REDUCED_COLOR_2;
+			if (reduction == 4) flags = IMREAD_REDUCED_COLOR_4;
+			if (reduction == 8) flags = IMREAD_REDUCED_COLOR_8;
+			Mat mat = imread(filename, flags | IMREAD_ANYDEPTH);
+			if (mat.depth() != CV_8U) mat.convertTo(mat, CV_32F, mat.depth() == CV_16U ? 255.0 / 65535 : 255.0);
+			wrap(mat);
+		}
+		/*与mat共享像素和引用计数 mat须为8位 16位浮点或32位浮点的1/3/4通道*/
+		explicit Texture(const Mat& mat) : averageFixed(false), stats_valid_(false), mips_valid_(false), apron(0), border(EDGE_CONSTANT) {
+			wrap(mat);
+		}
+		/*包装调用者持有的缓冲区 每行stride字节 缓冲区须比Texture活得久*/
+		Texture(unsigned char* buffer, int height, int width, int bytespp, size_t stride) : data(buffer), pixelHeight(height), pixelWidth(width),
+			bytespp(bytespp), averageFixed(false), stats_valid_(false), windowX(0), windowY(0), windowWidth(width), windowHeight(height), stride(stride), ownsData(false), layout(LINEAR), blocksX(0), channelStep(1), mips_valid_(false), apron(0), border(EDGE_CONSTANT),
+			type(PIXEL_8U), pixelBytes(bytespp) {
+		}
+		~Texture() {
+			if (ownsData) delete[] data;
+			for (int i = 0; i < mips_.size(); ++i)
+				delete mips_[i];
+		}
+		/*按border把整幅图像之外的坐标映射回图像内 CONSTANT保持不变*/
+		static inline int remap(int x, int n, BorderPolicy border) {
+			if (n <= 0) return x;
+			if (border == EDGE_CLAMP) return std::min(std::max(x, 0), n - 1);
+			if (border == EDGE_WRAP) return (x % n + n) % n;
+			if (border == EDGE_MIRROR) {
+				x = (x % (2 * n) + 2 * n) % (2 * n);
+				return x < n ? x : 2 * n - 1 - x;
+			}
+			return x;
 		}
 		Color get(int x, int y) {
-			if (x < 0 || y < 0 || x >= pixelWidth || y >= pixelHeight)
-				return Color();
-			return Color(data + (x + y * pixelWidth) * bytespp, bytespp);
+			if (border != EDGE_CONSTANT) {
+				x = remap(x, pixelWidth, border);
+				y = remap(y, pixelHeight, border);
+			}
+			x -= windowX;
+			y -= windowY;
+			if (x < 0 || y < 0 || x >= windowWidth || y >= windowHeight)
+				return border == EDGE_CONSTANT ? borderColor : Color();
+			return toColor(data + offsetOf(x, y));
+		}
+		/*与get相同 但保留浮点纹理的精度 out依次为4个通道*/
+		void getFloat(int x, int y, float* out) {
+			if (border != EDGE_CONSTANT) {
+				x = remap(x, pixelWidth, border);
+				y = remap(y, pixelHeight, border);
+			}
+			x -= windowX;
+			y -= windowY;
+			if (x < 0 || y < 0 || x >= windowWidth || y >= windowHeight) {
+				Color c = border == EDGE_CONSTANT ? borderColor : Color();
+				for (int i = 0; i < 4; ++i)
+					out[i] = c.raw[i];
+				return;
+			}
+			load(data + offsetOf(x, y), out);
+		}
+		bool setFloat(int x, int y, const float* v) {
+			x -= windowX;
+			y -= windowY;
+			if (!data || x < 0 || y < 0 || x >= windowWidth || y >= windowHeight)
+				return 0;
+			store(data + offsetOf(x, y), v);
+			return 1;
+		}
+		/*以(x, y)为中心(2*radius+1)^2个像素 按x为外层 y为内层的顺序写入out
+		  邻域完全落在窗口与apron内时直接读取 不做边界检查*/
+		void gather(int x, int y, int radius, Color* out) {
+			int lx = x - windowX, ly = y - windowY;
+			bool inside = lx - radius >= -apron && ly - radius >= -apron && lx + radius < windowWidth + apron && ly + radius < windowHeight + apron;
+			if (inside && type == PIXEL_8U) {
+				for (int i = -radius; i <= radius; ++i)
+					for (int j = -radius; j <= radius; ++j)
+						*out++ = color8(data + offsetOf(lx + i, ly + j));
+				return;
+			}
+			for (int i = -radius; i <= radius; ++i)
+				for (int j = -radius; j <= radius; ++j)
+					*out++ = get(x + i, y + j);
+		}
+		/*与gather相同 但保留16位和32位浮点纹理的精度 中间纹理经邻域节点读取时不再被截断到8位*/
+		void gatherFloat(int x, int y, int radius, Vec4f* out) {
+			int lx = x - windowX, ly = y - windowY;
+			bool inside = lx - radius >= -apron && ly - radius >= -apron && lx + radius < windowWidth + apron && ly + radius < windowHeight + apron;
+			for (int i = -radius; i <= radius; ++i)
+				for (int j = -radius; j <= radius; ++j, ++out) {
+					if (inside) load(data + offsetOf(lx + i, ly + j), out->raw);
+					else getFloat(x + i, y + j, out->raw);
+				}
 		}
 		bool set(int x, int y, Color& c) {
-			if (!data || x < 0 || y < 0 || x >= pixelWidth || y >= pixelHeight)
+			x -= windowX;
+			y -= windowY;
+			if (!data || x < 0 || y < 0 || x >= windowWidth || y >= windowHeight)
 				return 0;
-			memcpy(data + (x + y * pixelWidth) * bytespp, c.raw, bytespp);
+			if (type == PIXEL_8U && layout != PLANAR) {
+				memcpy(data + offsetOf(x, y), c.raw, bytespp);
+				return 1;
+			}
+			float v[4];
+			for (int i = 0; i < 4; ++i)
+				v[i] = c.raw[i];
+			store(data + offsetOf(x, y), v);
 			return 1;
 		}
+		/*只包含窗口内的像素 浮点纹理得到CV_16F或CV_32F的Mat 数值范围仍为0-255*/
 		Mat toMat() {
-			int sz[2] = { pixelHeight, pixelWidth };
+			int depth = type == PIXEL_32F ? CV_32F : type == PIXEL_16F ? CV_16F : CV_8U;
+			if (layout == PLANAR) {
+				Mat planes[4], out;
+				for (int c = 0; c < bytespp; ++c)
+					planes[c] = plane(c);
+				merge(planes, bytespp, out);
+				return out;
+			}
+			if (layout == BLOCKED) {
+				Mat out(windowHeight, windowWidth, CV_MAKETYPE(depth, bytespp));
+				for (int y = 0; y < windowHeight; ++y)
+					for (int x = 0; x < windowWidth; ++x)
+						memcpy(out.data + y * out.step + x * pixelBytes, data + offsetOf(x, y), pixelBytes);
+				return out;
+			}
+			if (type != PIXEL_8U)
+				return cv::Mat(windowHeight, windowWidth, CV_MAKETYPE(depth, bytespp), data + offsetOf(0, 0), stride);
 			if (bytespp == GRAYSCALE)
-				return cv::Mat(2, sz, CV_8UC1, data);
+				return cv::Mat(windowHeight, windowWidth, CV_8UC1, data + offsetOf(0, 0), stride);
 			if (bytespp == RGB)
-				return cv::Mat(2, sz, CV_8UC3, data);
+				return cv::Mat(windowHeight, windowWidth, CV_8UC3, data + offsetOf(0, 0), stride);
 			if (bytespp == RGBA)
-				return cv::Mat(2, sz, CV_8UC4, data);
+				return cv::Mat(windowHeight, windowWidth, CV_8UC4, data + offsetOf(0, 0), stride);
+			return Mat();
+		}
+		/*PLANAR布局第channel个通道平面的窗口部分 与纹理共享像素*/
+		Mat plane(int channel) {
+			int depth = type == PIXEL_32F ? CV_32F : type == PIXEL_16F ? CV_16F : CV_8U;
+			return cv::Mat(windowHeight, windowWidth, CV_MAKETYPE(depth, 1), data + offsetOf(0, 0) + channel * channelStep, stride);
+		}
+		/*浮点纹理按255对应1.0写出 应使用EXR等支持浮点的格式*/
+		bool save(const std::string& filename) {
+			Mat mat = toMat();
+			if (type != PIXEL_8U) mat.convertTo(mat, CV_32F, 1.0 / 255);
+			return imwrite(filename, mat);
+		}
+		/*按原始格式写出 连同统计量一起保存 先写临时文件再改名 其他进程不会读到写了一半的文件*/
+		bool saveRaw(const std::string& path, long long source_mtime) {
+			if (layout != LINEAR || isWindowed() || pixelWidth <= 0 || pixelHeight <= 0) return false;
+			const TextureStatistics& st = statistics();
+			RawTextureHeader header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, "PGRT", 4);
+			header.version = RAW_TEXTURE_VERSION;
+			header.width = pixelWidth;
+			header.height = pixelHeight;
+			header.bytespp = bytespp;
+			header.type = type;
+			header.stride = (long long)pixelWidth * pixelBytes;
+			header.data_offset = ((long long)sizeof(header) + RAW_TEXTURE_ALIGN - 1) / RAW_TEXTURE_ALIGN * RAW_TEXTURE_ALIGN;
+			header.source_mtime = source_mtime;
+			header.count = (long long)st.count;
+			for (int c = 0; c < 4; ++c) {
+				header.mean[c] = st.mean[c];
+				header.minimum[c] = st.minimum[c];
+				header.maximum[c] = st.maximum[c];
+				for (int i = 0; i < 256; ++i)
+					header.histogram[c][i] = st.histogram[c][i];
+			}
+
+			/*同一个键可能被多个线程或进程同时写出 各自使用不同的临时文件 rename保证读到的总是完整的文件*/
+			static std::atomic<unsigned> counter(0);
+#ifdef _WIN32
+			unsigned long pid = GetCurrentProcessId();
+#else
+			unsigned long pid = (unsigned long)getpid();
+#endif
+			std::string temp = path + "." + std::to_string(pid) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()))
+				+ "." + std::to_string(counter++) + ".tmp";
+			FILE* file = NULL;
+#ifdef _WIN32
+			if (fopen_s(&file, temp.c_str(), "wb") != 0) file = NULL;
+#else
+			file = fopen(temp.c_str(), "wb");
+#endif
+			if (file == NULL) return false;
+			std::vector<char> padding((size_t)header.data_offset - sizeof(header), 0);
+			bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(padding.data(), 1, padding.size(), file) == padding.size();
+			for (int y = 0; ok && y < pixelHeight; ++y)
+				ok = fwrite(getRow(y), 1, (size_t)header.stride, file) == (size_t)header.stride;
+			ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+			if (ok) remove(path.c_str()); /*Windows上rename不会覆盖已有文件*/
+#endif
+			if (ok) ok = rename(temp.c_str(), path.c_str()) == 0;
+			if (!ok) remove(temp.c_str());
+			return ok;
+		}
+		/*APP1段中EXIF的Orientation(0x0112) 没有或无法解析时为1 5到8表示解码时宽高互换*/
+		static int exifOrientation(const unsigned char* p, size_t size) {
+			if (size < 14 || memcmp(p, "Exif\0\0", 6) != 0) return 1;
+			const unsigned char* tiff = p + 6;
+			size_t n = size - 6;
+			bool little = tiff[0] == 'I' && tiff[1] == 'I';
+			if (!little && !(tiff[0] == 'M' && tiff[1] == 'M')) return 1;
+			auto get16 = [&](size_t at) -> unsigned { return little ? tiff[at] | tiff[at + 1] << 8 : tiff[at] << 8 | tiff[at + 1]; };
+			auto get32 = [&](size_t at) -> size_t { return little ? (size_t)get16(at) | (size_t)get16(at + 2) << 16 : (size_t)get16(at) << 16 | get16(at + 2); };
+			size_t ifd = get32(4);
+			if (ifd + 2 > n) return 1;
+			unsigned count = get16(ifd);
+			for (unsigned i = 0; i < count && ifd + 2 + (i + 1) * 12 <= n; ++i) {
+				size_t entry = ifd + 2 + i * 12;
+				if (get16(entry) == 0x0112) {
+					unsigned orientation = get16(entry + 8);
+					return orientation >= 1 && orientation <= 8 ? (int)orientation : 1;
+				}
+			}
+			return 1;
+		}
+		/*只读取JPEG或PNG文件头中的尺寸 不解码 其他格式返回false
+		  JPEG按EXIF方向给出解码(imread会旋转)之后的宽高*/
+		static bool readImageSize(const std::string& path, int& width, int& height) {
+			FILE* file = NULL;
+#ifdef _WIN32
+			if (fopen_s(&file, path.c_str(), "rb") != 0) file = NULL;
+#else
+			file = fopen(path.c_str(), "rb");
+#endif
+			if (file == NULL) return false;
+			unsigned char b[24];
+			bool ok = false;
+			if (fread(b, 1, 2, file) == 2 && b[0] == 0xFF && b[1] == 0xD8) {
+				/*依次跳过各段 直到SOF段 DHT(C4) JPG(C8) DAC(CC)不是SOF APP1中记下EXIF方向*/
+				int orientation = 1;
+				while (fgetc(file) == 0xFF) {
+					int marker;
+					do marker = fgetc(file); while (marker == 0xFF);
+					if (marker == EOF || marker == 0xD9 || marker == 0xDA) break;
+					if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) continue;
+					if (fread(b, 1, 2, file) != 2) break;
+					int length = b[0] << 8 | b[1];
+					if (marker == 0xE1 && length > 2) {
+						std::vector<unsigned char> app(length - 2);
+						if (fread(app.data(), 1, app.size(), file) != app.size()) break;
+						if (orientation == 1) orientation = exifOrientation(app.data(), app.size());
+						continue;
+					}
+					if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+						if (fread(b, 1, 5, file) == 5) {
+							height = b[1] << 8 | b[2];
+							width = b[3] << 8 | b[4];
+							if (orientation >= 5) std::swap(width, height);
+							ok = width > 0 && height > 0;
+						}
+						break;
+					}
+					if (length < 2 || fseek(file, length - 2, SEEK_CUR) != 0) break;
+				}
+			}
+			else if (fseek(file, 0, SEEK_SET) == 0 && fread(b, 1, 24, file) == 24 && memcmp(b, "\x89PNG\r\n\x1a\n", 8) == 0 && memcmp(b + 12, "IHDR", 4) == 0) {
+				width = (int)((unsigned)b[16] << 24 | b[17] << 16 | b[18] << 8 | b[19]);
+				height = (int)((unsigned)b[20] << 24 | b[21] << 16 | b[22] << 8 | b[23]);
+				ok = width > 0 && height > 0;
+			}
+			fclose(file);
+			return ok;
+		}
+		/*缩小解码后仍不小于width*height的最大倍数(1 2 4 8) 读不出尺寸时为1
+		  readImageSize已按EXIF方向给出解码后的宽高 只需比较这一种方向*/
+		static int reductionFor(const std::string& path, int width, int height) {
+			int w, h;
+			if (width <= 0 || height <= 0 || !readImageSize(path, w, h)) return 1;
+			int reduction = 1;
+			while (reduction < 8) {
+				int r = reduction * 2;
+				if (w / r < width || h / r < height) break;
+				reduction = r;
+			}
+			return reduction;
+		}
+		/*映射saveRaw写出的文件 像素不解码不复制 统计量直接取自头部
+		  文件无效或source_mtime不一致时返回NULL*/
+		static Texture* openRaw(const std::string& path, long long source_mtime) {
+			std::shared_ptr<MappedFile> file(MappedFile::open(path));
+			if (file == NULL || file->size() < sizeof(RawTextureHeader)) return NULL;
+			const RawTextureHeader& header = *(const RawTextureHeader*)file->data();
+			int bytes = header.type == PIXEL_32F ? 4 : header.type == PIXEL_16F ? 2 : 1;
+			if (memcmp(header.magic, "PGRT", 4) != 0 || header.version != RAW_TEXTURE_VERSION || header.source_mtime != source_mtime
+				|| header.width <= 0 || header.height <= 0 || header.type < PIXEL_8U || header.type > PIXEL_32F
+				|| (header.bytespp != GRAYSCALE && header.bytespp != RGB && header.bytespp != RGBA)
+				|| header.stride < (long long)header.width * header.bytespp * bytes || header.data_offset < (long long)sizeof(header)
+				|| (unsigned long long)header.data_offset + (unsigned long long)header.stride * header.height > file->size())
+				return NULL;
+
+			Texture* tex = new Texture(file->data() + header.data_offset, header.height, header.width, header.bytespp, (size_t)header.stride);
+			tex->mapping = file;
+			tex->type = (PixelType)header.type;
+			tex->pixelBytes = header.bytespp * bytes;
+			tex->channelStep = bytes;
+			tex->stats_.count = (size_t)header.count;
+			for (int c = 0; c < 4; ++c) {
+				tex->stats_.mean[c] = header.mean[c];
+				tex->stats_.minimum[c] = header.minimum[c];
+				tex->stats_.maximum[c] = header.maximum[c];
+				for (int i = 0; i < 256; ++i)
+					tex->stats_.histogram[c][i] = (size_t)header.histogram[c][i];
+			}
+			tex->stats_valid_ = true;
+			return tex;
 		}
 		inline int getPixelHeight() { return pixelHeight; }
 		inline int getPixelWidth() { return pixelWidth; }
 		inline int getBytespp() { return bytespp; }
+		inline PixelType getPixelType() { return type; }
+		inline int getPixelBytes() { return pixelBytes; }
 		inline unsigned char* getData() { return data; }
+		/*窗口内第y行 下标从windowX开始 仅用于LINEAR布局 PLANAR布局为第一个平面的一行*/
+		inline unsigned char* getRow(int y) { return data + offsetOf(0, y - windowY); }
+		inline size_t getStride() { return stride; }
+		inline bool isWindowed() { return windowWidth != pixelWidth || windowHeight != pixelHeight; }
+		inline int getWindowWidth() { return windowWidth; }
+		inline int getWindowHeight() { return windowHeight; }
+		inline Layout getLayout() { return layout; }
+		inline int getApron() { return apron; }
+		inline BorderPolicy getBorder() { return border; }
+		/*只影响之后的读取 已填好的apron不会改变*/
+		void setBorder(BorderPolicy policy, Color color = Color()) {
+			border = policy;
+			borderColor = color;
+		}
 
-		Vec4f calculateAverageRGB() {
-			Vec4f avg(0, 0, 0, 0);
-			int count = pixelWidth * pixelHeight;
-				
-			for (int i = 0; i < pixelWidth; i++) {
-				for (int j = 0; j < pixelHeight; j++) {
-					unsigned char * p=data + (i + j * pixelWidth) * bytespp;
-					avg[0] += p[0];
-					avg[1] += p[1];
-					avg[2] += p[2];
-				}
-			}
-			if (count > 0) {
-				avg[0] /= count;
-				avg[1] /= count;
-				avg[2] /= count;
+		/*第level层mip 0为纹理本身 超过最后一层时返回最后一层 窗口纹理没有mip
+		  多个线程同时请求时只生成一次*/
+		Texture* getMip(int level) {
+			if (level <= 0 || isWindowed()) return this;
+			if (!mips_valid_.load(std::memory_order_acquire)) {
+				std::lock_guard<std::mutex> lock(mips_mutex_);
+				if (!mips_valid_.load(std::memory_order_relaxed)) {
+					buildMips();
+					mips_valid_.store(true, std::memory_order_release);
+				}
 			}
-			return avg;
+			if (mips_.empty()) return this;
+			return mips_[std::min(level, (int)mips_.size()) - 1];
 		}
-		Vec4f getAverageRGB() {
-			return averageRGB;
+		/*像素内容被重写后(如作为渲染目标)调用 mip和统计量在下次使用时重新生成*/
+		void markModified() {
+			mips_valid_ = false;
+			stats_valid_ = false;
+		}
+		/*u v为纹理坐标 像素中心位于(i + 0.5) / 宽 out依次为4个通道*/
+		void sampleBilinear(float u, float v, float* out) {
+			float fx = u * pixelWidth - 0.5f, fy = v * pixelHeight - 0.5f;
+			int x = (int)floorf(fx), y = (int)floorf(fy);
+			float ax = fx - x, ay = fy - y;
+			if (type != PIXEL_8U) {
+				float p[4][4];
+				for (int k = 0; k < 4; ++k)
+					getFloat(std::min(std::max(x + (k & 1), 0), pixelWidth - 1), std::min(std::max(y + (k >> 1), 0), pixelHeight - 1), p[k]);
+				for (int c = 0; c < 4; ++c) {
+					float top = p[0][c] + (p[1][c] - p[0][c]) * ax;
+					float bottom = p[2][c] + (p[3][c] - p[2][c]) * ax;
+					out[c] = top + (bottom - top) * ay;
+				}
+				return;
+			}
+			unsigned int c00 = texel(x, y), c10 = texel(x + 1, y), c01 = texel(x, y + 1), c11 = texel(x + 1, y + 1);
+#ifdef PHOTOGRAPH_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			__m128 p00 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(c00), zero), zero));
+			__m128 p10 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(c10), zero), zero));
+			__m128 p01 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(c01), zero), zero));
+			__m128 p11 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(c11), zero), zero));
+			__m128 wx = _mm_set1_ps(ax), wy = _mm_set1_ps(ay);
+			__m128 top = _mm_add_ps(p00, _mm_mul_ps(_mm_sub_ps(p10, p00), wx));
+			__m128 bottom = _mm_add_ps(p01, _mm_mul_ps(_mm_sub_ps(p11, p01), wx));
+			_mm_storeu_ps(out, _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), wy)));
+#else
+			for (int c = 0; c < 4; ++c) {
+				int shift = c * 8;
+				float top = ((c00 >> shift) & 0xff) + (((c10 >> shift) & 0xff) - (float)((c00 >> shift) & 0xff)) * ax;
+				float bottom = ((c01 >> shift) & 0xff) + (((c11 >> shift) & 0xff) - (float)((c01 >> shift) & 0xff)) * ax;
+				out[c] = top + (bottom - top) * ay;
+			}
+#endif
+		}
+		/*lod为以2为底的缩小倍数 只读取所需的一到两层mip*/
+		void sample(float u, float v, SampleMode mode, float lod, float* out) {
+			if (mode == SAMPLE_NEAREST && type != PIXEL_8U) {
+				getFloat(u * pixelWidth, v * pixelHeight, out);
+				return;
+			}
+			if (mode == SAMPLE_NEAREST) {
+				Color c = get(u * pixelWidth, v * pixelHeight);
+				for (int i = 0; i < 4; ++i)
+					out[i] = c.raw[i];
+				return;
+			}
+			if (lod <= 0) {
+				sampleBilinear(u, v, out);
+				return;
+			}
+			if (mode == SAMPLE_BILINEAR) {
+				getMip((int)(lod + 0.5f))->sampleBilinear(u, v, out);
+				return;
+			}
+			int level = (int)lod;
+			float t = lod - level, next[4];
+			getMip(level)->sampleBilinear(u, v, out);
+			getMip(level + 1)->sampleBilinear(u, v, next);
+			for (int i = 0; i < 4; ++i)
+				out[i] += (next[i] - out[i]) * t;
 		}
 
+		/*复制为指定布局的新纹理 四周apron宽的像素按policy填好 仅用于非窗口纹理
+		  LINEAR转为PLANAR时内部像素由cv::split一次拆分 LINEAR转为LINEAR时内部逐行memcpy 只有apron逐像素填写*/
+		Texture* copyWith(Layout layout, int apron, BorderPolicy policy, Color color = Color()) {
+			Texture* out = new Texture(pixelHeight, pixelWidth, bytespp, layout, apron, type);
+			out->setBorder(policy, color);
+			float constant[4];
+			for (int i = 0; i < 4; ++i)
+				constant[i] = color.raw[i];
+			bool split = layout == PLANAR && this->layout == LINEAR;
+			if (split) {
+				Mat planes[4];
+				for (int c = 0; c < bytespp; ++c)
+					planes[c] = out->plane(c);
+				cv::split(toMat(), planes);
+			}
+			bool rows = layout == LINEAR && this->layout == LINEAR;
+			if (rows)
+				for (int y = 0; y < pixelHeight; ++y)
+					memcpy(out->data + out->offsetOf(0, y), data + offsetOf(0, y), (size_t)pixelWidth * pixelBytes);
+			bool interleaved = layout != PLANAR && this->layout != PLANAR;
+			size_t elem = pixelBytes / bytespp;
+			for (int y = -apron; y < pixelHeight + apron; ++y)
+				for (int x = -apron; x < pixelWidth + apron; ++x) {
+					if ((split || rows) && x == 0 && y >= 0 && y < pixelHeight) {
+						x = pixelWidth - 1;
+						continue;
+					}
+					int sx = remap(x, pixelWidth, policy), sy = remap(y, pixelHeight, policy);
+					unsigned char* q = out->data + out->offsetOf(x, y);
+					if (sx < 0 || sy < 0 || sx >= pixelWidth || sy >= pixelHeight) out->store(q, constant);
+					else if (interleaved) memcpy(q, data + offsetOf(sx, sy), pixelBytes);
+					else
+						for (int c = 0; c < bytespp; ++c)
+							memcpy(q + c * out->channelStep, data + offsetOf(sx, sy) + c * channelStep, elem);
+				}
+			out->averageRGB = averageRGB;
+			out->averageFixed = averageFixed;
+			return out;
+		}
+		/*PLANAR布局8位纹理第channel个通道上 从(x, y)开始同一行连续count个像素各自(2*radius+1)^2邻域的最大值 最小值或平均值
+		  邻域须落在窗口和apron之内 SSE2下每次处理16个像素*/
+		void reduceWindow(int channel, int x, int y, int count, int radius, WindowOp op, float* out) {
+			x -= windowX;
+			y -= windowY;
+			const unsigned char* base = data + channel * channelStep;
+			int side = 2 * radius + 1, n = side * side;
+			int i = 0;
+#ifdef PHOTOGRAPH_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			const __m128 divisor = _mm_set1_ps((float)n);
+			/*平均值按16位累加 邻域过大时可能溢出 交给标量部分*/
+			for (; i + 16 <= count && (op != WINDOW_MEAN || n * 255 <= 0xffff); i += 16) {
+				__m128i acc = op == WINDOW_MIN ? _mm_set1_epi8(-1) : zero, lo = zero, hi = zero;
+				for (int dy = -radius; dy <= radius; ++dy) {
+					const unsigned char* row = base + offsetOf(x + i - radius, y + dy);
+					for (int dx = 0; dx < side; ++dx) {
+						__m128i v = _mm_loadu_si128((const __m128i*)(row + dx));
+						if (op == WINDOW_MAX) acc = _mm_max_epu8(acc, v);
+						else if (op == WINDOW_MIN) acc = _mm_min_epu8(acc, v);
+						else {
+							lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+							hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+						}
+					}
+				}
+				if (op != WINDOW_MEAN) {
+					lo = _mm_unpacklo_epi8(acc, zero);
+					hi = _mm_unpackhi_epi8(acc, zero);
+				}
+				__m128i parts[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+				for (int k = 0; k < 4; ++k) {
+					__m128 f = _mm_cvtepi32_ps(parts[k]);
+					if (op == WINDOW_MEAN) f = _mm_div_ps(f, divisor);
+					_mm_storeu_ps(out + i + 4 * k, f);
+				}
+			}
+#endif
+			for (; i < count; ++i) {
+				int acc = op == WINDOW_MIN ? 255 : 0;
+				for (int dy = -radius; dy <= radius; ++dy) {
+					const unsigned char* row = base + offsetOf(x + i - radius, y + dy);
+					for (int dx = 0; dx < side; ++dx) {
+						if (op == WINDOW_MAX) acc = std::max(acc, (int)row[dx]);
+						else if (op == WINDOW_MIN) acc = std::min(acc, (int)row[dx]);
+						else acc += row[dx];
+					}
+				}
+				out[i] = op == WINDOW_MEAN ? (float)acc / n : (float)acc;
+			}
+		}
 
+		/*第一次需要时计算 之后直接返回 直到markModified*/
+		const TextureStatistics& statistics() {
+			if (!stats_valid_.load(std::memory_order_acquire)) {
+				std::lock_guard<std::mutex> lock(stats_mutex_);
+				if (!stats_valid_.load(std::memory_order_relaxed)) {
+					computeStatistics();
+					stats_valid_.store(true, std::memory_order_release);
+				}
+			}
+			return stats_;
+		}
+		Vec4f calculateAverageRGB() {
+			Vec4f avg = statistics().mean;
+			avg.a = 0;
+			return avg;
+		}
+		Vec4f getAverageRGB() {
+			return averageFixed ? averageRGB : calculateAverageRGB();
+		}
+		/*窗口纹理的平均值需要由整幅图像求得*/
+		void setAverageRGB(Vec4f avg) {
+			averageRGB = avg;
+			averageFixed = true;
+		}
 	};
 }
 
@@ -0,0 +1,164 @@
+#pragma once
+
+#ifndef _TEXTURE_CACHE_H
+#define _TEXTURE_CACHE_H
+
+#include "texture.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace PhotoGraph {
+	/*进程内共享的纹理缓存 以路径 缩小解码倍数和修改时间区分 超出字节预算时淘汰最久未使用的纹理
+	  被淘汰的纹理仍由持有它的节点共享 最后一个持有者释放时才真正释放
+	  设置了原始缓存目录时 解码结果同时以原始格式写入该目录 下次启动直接映射而不再解码*/
+	class TextureCache {
+	private:
+		struct Entry {
+			std::shared_ptr<Texture> tex;
+			long long mtime;
+			size_t bytes;
+			std::list<std::string>::iterator lru; /*在lru_中的位置 越靠前越近使用*/
+		};
+		std::map<std::string, Entry> entries_;
+		std::list<std::string> lru_;
+		size_t budget_;
+		size_t used_;
+		size_t hits_;
+		size_t misses_;
+		size_t raw_hits_;
+		std::string raw_dir_;
+		std::mutex mutex_;
+
+		/*文件不存在时返回-1*/
+		static long long modifiedTime(const std::string& path) {
+#ifdef _WIN32
+			struct __stat64 st;
+			if (_stat64(path.c_str(), &st) != 0) return -1;
+#else
+			struct stat st;
+			if (stat(path.c_str(), &st) != 0) return -1;
+#endif
+			return (long long)st.st_mtime;
+		}
+		/*原始缓存的文件名由缓存键(路径和缩小倍数)的FNV-1a散列得到 不同进程间保持一致*/
+		static std::string rawPath(const std::string& dir, const std::string& path) {
+			unsigned long long hash = 14695981039346656037ULL;
+			for (size_t i = 0; i < path.size(); ++i)
+				hash = (hash ^ (unsigned char)path[i]) * 1099511628211ULL;
+			char name[32];
+			snprintf(name, sizeof(name), "%016llx.pgrt", hash);
+			return dir + "/" + name;
+		}
+		/*优先映射原始缓存 不存在或已过期时解码并写入缓存 写入失败不影响返回的纹理*/
+		Texture* decode(const std::string& path, int reduction, const std::string& key, long long mtime, const std::string& dir) {
+			if (dir.empty() || mtime < 0) return new Texture(path, reduction);
+			std::string raw = rawPath(dir, key);
+			Texture* tex = Texture::openRaw(raw, mtime);
+			if (tex != NULL) {
+				std::lock_guard<std::mutex> lock(mutex_);
+				raw_hits_++;
+				return tex;
+			}
+			tex = new Texture(path, reduction);
+			if (tex->getPixelWidth() > 0 && tex->getPixelHeight() > 0) tex->saveRaw(raw, mtime);
+			return tex;
+		}
+		/*按实际占用的行字节数计算 16位和浮点纹理每个通道不止一个字节*/
+		static size_t bytesOf(Texture* tex) {
+			return (size_t)tex->getWindowHeight() * tex->getStride();
+		}
+		void erase(std::map<std::string, Entry>::iterator it) {
+			used_ -= it->second.bytes;
+			lru_.erase(it->second.lru);
+			entries_.erase(it);
+		}
+		void evict() {
+			while (used_ > budget_ && !lru_.empty())
+				erase(entries_.find(lru_.back()));
+		}
+
+	public:
+		TextureCache(size_t budget = (size_t)512 << 20) : budget_(budget), used_(0), hits_(0), misses_(0), raw_hits_(0) {}
+
+		/*解码在锁外进行 同时加载同一文件时保留先放入缓存的那一份*/
+		std::shared_ptr<Texture> load(const std::string& path, int reduction = 1) {
+			long long mtime = modifiedTime(path);
+			std::string key = reduction > 1 ? path + "|" + std::to_string(reduction) : path; /*Windows路径中不会出现'|'*/
+			std::string dir;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				dir = raw_dir_;
+				std::map<std::string, Entry>::iterator it = entries_.find(key);
+				if (it != entries_.end()) {
+					if (it->second.mtime == mtime) {
+						hits_++;
+						lru_.splice(lru_.begin(), lru_, it->second.lru);
+						return it->second.tex;
+					}
+					erase(it);
+				}
+				misses_++;
+			}
+			std::shared_ptr<Texture> tex(decode(path, reduction, key, mtime, dir));
+			size_t bytes = bytesOf(tex.get());
+			if (mtime < 0 || bytes == 0) return tex; /*读取失败的结果不缓存*/
+
+			std::lock_guard<std::mutex> lock(mutex_);
+			std::map<std::string, Entry>::iterator it = entries_.find(key);
+			if (it != entries_.end() && it->second.mtime == mtime) return it->second.tex;
+			if (it != entries_.end()) erase(it);
+			lru_.push_front(key);
+			Entry& entry = entries_[key];
+			entry.tex = tex;
+			entry.mtime = mtime;
+			entry.bytes = bytes;
+			entry.lru = lru_.begin();
+			used_ += bytes;
+			evict();
+			return tex;
+		}
+		void setBudget(size_t budget) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			budget_ = budget;
+			evict();
+		}
+		/*dir为空时关闭原始缓存 目录不存在时创建(只创建最后一级)*/
+		void setRawCacheDirectory(const std::string& dir) {
+			if (!dir.empty()) {
+#ifdef _WIN32
+				_mkdir(dir.c_str());
+#else
+				mkdir(dir.c_str(), 0755);
+#endif
+			}
+			std::lock_guard<std::mutex> lock(mutex_);
+			raw_dir_ = dir;
+		}
+		void clear() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			entries_.clear();
+			lru_.clear();
+			used_ = 0;
+		}
+		inline size_t getBudget() { return budget_; }
+		inline size_t getUsedBytes() { return used_; }
+		inline size_t getHits() { return hits_; }
+		inline size_t getMisses() { return misses_; }
+		inline size_t getRawHits() { return raw_hits_; }
+
+		static TextureCache& global() {
+			static TextureCache cache;
+			return cache;
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef _TEXTURE_POOL_H
+#define _TEXTURE_POOL_H
+
+#include "texture.h"
+#include <vector>
+
+namespace PhotoGraph {
+	/*输出与中间纹理池 同尺寸的纹理在Stage之间以及多次渲染之间复用
+	  闲置纹理总字节数超过预算时立即释放 不会随渲染次数无限增长*/
+	class TexturePool {
+	private:
+		std::vector<Texture*> free_;
+		size_t idle_bytes_;
+		size_t budget_;
+		static size_t bytesOf(Texture* tex) {
+			return (size_t)tex->getWindowHeight() * tex->getStride();
+		}
+		TexturePool(const TexturePool&);
+		TexturePool& operator = (const TexturePool&);
+	public:
+		TexturePool(size_t budget = (size_t)512 << 20) : idle_bytes_(0), budget_(budget) {}
+		~TexturePool() {
+			trim(0);
+		}
+		/*取出的内容是上一次使用留下的或未初始化的 调用者会覆盖每一个像素*/
+		Texture* acquire(int height, int width, int bytespp = RGBA, PixelType type = PIXEL_8U) {
+			for (int i = 0; i < free_.size(); ++i) {
+				Texture* tex = free_[i];
+				if (tex->getPixelHeight() == height && tex->getPixelWidth() == width && tex->getBytespp() == bytespp && tex->getPixelType() == type && !tex->isWindowed()) {
+					free_[i] = free_.back();
+					free_.pop_back();
+					idle_bytes_ -= bytesOf(tex);
+					return tex;
+				}
+			}
+			/*指定布局的构造函数不做memset*/
+			return new Texture(height, width, bytespp, LINEAR, 0, type);
+		}
+		void release(Texture* tex) {
+			if (tex == NULL) return;
+			free_.push_back(tex);
+			idle_bytes_ += bytesOf(tex);
+			trim(budget_);
+		}
+		/*先释放最早归还的纹理 直到闲置字节数不超过bytes*/
+		void trim(size_t bytes) {
+			size_t i = 0;
+			for (; i < free_.size() && idle_bytes_ > bytes; ++i) {
+				idle_bytes_ -= bytesOf(free_[i]);
+				delete free_[i];
+			}
+			free_.erase(free_.begin(), free_.begin() + i);
+		}
+		void setBudget(size_t budget) {
+			budget_ = budget;
+			trim(budget_);
+		}
+		inline size_t idleCount() { return free_.size(); }
+		inline size_t idleBytes() { return idle_bytes_; }
+	};
+}
+
+#endif
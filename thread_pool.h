@@ -0,0 +1,112 @@
+#pragma once
+
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace PhotoGraph {
+	/*常驻线程池 调用parallelFor的线程自身也参与计算*/
+	class ThreadPool {
+	private:
+		struct ParallelJob {
+			std::atomic<int> next;
+			std::atomic<int> done;
+			int count;
+			std::function<void(int, int)> fn;
+			std::mutex mutex;
+			std::condition_variable finished;
+		};
+
+		std::vector<std::thread> workers_;
+		std::queue<std::function<void()> > tasks_;
+		std::mutex mutex_;
+		std::condition_variable cv_;
+		bool stop_;
+
+		void loop() {
+			while (true) {
+				std::function<void()> task;
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+					if (stop_ && tasks_.empty()) return;
+					task = std::move(tasks_.front());
+					tasks_.pop();
+				}
+				task();
+			}
+		}
+
+		static void runJob(std::shared_ptr<ParallelJob> job, int worker) {
+			int i;
+			while ((i = job->next++) < job->count) {
+				job->fn(i, worker);
+				if (++job->done == job->count) {
+					std::lock_guard<std::mutex> lock(job->mutex);
+					job->finished.notify_all();
+				}
+			}
+		}
+
+	public:
+		ThreadPool(int threads = 0) : stop_(false) {
+			if (threads <= 0) threads = (int)std::thread::hardware_concurrency() - 1;
+			for (int i = 0; i < threads; ++i)
+				workers_.push_back(std::thread(&ThreadPool::loop, this));
+		}
+		~ThreadPool() {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stop_ = true;
+			}
+			cv_.notify_all();
+			for (size_t i = 0; i < workers_.size(); ++i)
+				workers_[i].join();
+		}
+
+		/*包括调用线程在内的并发数 worker编号范围为[0, concurrency())*/
+		inline int concurrency() {
+			return (int)workers_.size() + 1;
+		}
+
+		void submit(std::function<void()> task) {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				tasks_.push(std::move(task));
+			}
+			cv_.notify_one();
+		}
+
+		/*fn(index, worker) 对[0, count)各调用一次 同一worker编号不会并发*/
+		void parallelFor(int count, std::function<void(int, int)> fn) {
+			if (count <= 0) return;
+			std::shared_ptr<ParallelJob> job = std::make_shared<ParallelJob>();
+			job->next = 0;
+			job->done = 0;
+			job->count = count;
+			job->fn = fn;
+			int helpers = std::min((int)workers_.size(), count - 1);
+			for (int w = 1; w <= helpers; ++w)
+				submit([job, w] { runJob(job, w); });
+			runJob(job, 0);
+			std::unique_lock<std::mutex> lock(job->mutex);
+			job->finished.wait(lock, [&job] { return job->done == job->count; });
+		}
+
+		static ThreadPool& global() {
+			static ThreadPool pool;
+			return pool;
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,164 @@
+#pragma once
+
+#ifndef _TILED_FILE_H
+#define _TILED_FILE_H
+
+#include "texture.h"
+#include <stdio.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace PhotoGraph {
+	class TiledFileException : public std::runtime_error {
+	public:
+		TiledFileException(const std::string& reason) : std::runtime_error(reason) {}
+		virtual ~TiledFileException() throw() {}
+	};
+
+	class TiledFileReadException : public TiledFileException {
+	public:
+		TiledFileReadException(const std::string& reason) : TiledFileException(reason) {}
+		virtual ~TiledFileReadException() throw() {}
+	};
+
+	class TiledFileWriteException : public TiledFileException {
+	public:
+		TiledFileWriteException(const std::string& reason) : TiledFileException(reason) {}
+		virtual ~TiledFileWriteException() throw() {}
+	};
+
+	struct TiledFileHeader {
+		char magic[4]; /*"PGTF"*/
+		int width;
+		int height;
+		int tile_size;
+		int bytespp;
+	};
+
+	/*分块存储的原始图像文件 头部之后按行优先依次存放每个tile_size*tile_size的块(边缘块同样补满)
+	  可以只读写其中任意一个矩形区域 用于处理大于内存的图像*/
+	class TiledFile {
+	private:
+		FILE* file_;
+		TiledFileHeader header_;
+		int tiles_x_;
+
+		TiledFile(FILE* file, const TiledFileHeader& header) : file_(file), header_(header) {
+			tiles_x_ = (header.width + header.tile_size - 1) / header.tile_size;
+		}
+		TiledFile(const TiledFile&);
+		TiledFile& operator = (const TiledFile&);
+
+		static FILE* openFile(const std::string& path, const char* mode) {
+			FILE* file = NULL;
+#ifdef _WIN32
+			if (fopen_s(&file, path.c_str(), mode) != 0) return NULL;
+#else
+			file = fopen(path.c_str(), mode);
+#endif
+			return file;
+		}
+		/*超过2GB的文件需要64位偏移*/
+		inline bool seek(long long offset) {
+#ifdef _WIN32
+			return _fseeki64(file_, offset, SEEK_SET) == 0;
+#else
+			return fseeko(file_, (off_t)offset, SEEK_SET) == 0;
+#endif
+		}
+		inline long long offsetOf(int x, int y) {
+			int ts = header_.tile_size;
+			long long tile = (long long)(y / ts) * tiles_x_ + x / ts;
+			return sizeof(TiledFileHeader) + (tile * ts * ts + (y % ts) * ts + x % ts) * header_.bytespp;
+		}
+		/*对区域内每个tile中的每一行调用一次 fn(文件偏移, 区域内的x, 区域内的y, 像素数)*/
+		template <typename F>
+		void forEachSpan(int x, int y, int w, int h, F fn) {
+			int ts = header_.tile_size;
+			for (int ty = y / ts * ts; ty < y + h; ty += ts)
+				for (int tx = x / ts * ts; tx < x + w; tx += ts) {
+					int x0 = std::max(x, tx), x1 = std::min(x + w, tx + ts);
+					int y0 = std::max(y, ty), y1 = std::min(y + h, ty + ts);
+					for (int row = y0; row < y1; ++row)
+						fn(offsetOf(x0, row), x0 - x, row - y, x1 - x0);
+				}
+		}
+
+	public:
+		~TiledFile() {
+			if (file_ != NULL) fclose(file_);
+		}
+		/*文件无法打开时返回NULL 头部写入失败时抛出TiledFileWriteException*/
+		static TiledFile* create(const std::string& path, int width, int height, int bytespp, int tile_size = 256) {
+			FILE* file = openFile(path, "wb+");
+			if (file == NULL) return NULL;
+			TiledFileHeader header;
+			memcpy(header.magic, "PGTF", 4);
+			header.width = width;
+			header.height = height;
+			header.tile_size = tile_size;
+			header.bytespp = bytespp;
+			if (fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file) != 0) {
+				fclose(file);
+				throw TiledFileWriteException("Cannot write the header of " + path);
+			}
+			return new TiledFile(file, header);
+		}
+		static TiledFile* open(const std::string& path) {
+			FILE* file = openFile(path, "rb");
+			if (file == NULL) return NULL;
+			TiledFileHeader header;
+			if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "PGTF", 4) != 0) {
+				fclose(file);
+				return NULL;
+			}
+			return new TiledFile(file, header);
+		}
+		inline int getWidth() { return header_.width; }
+		inline int getHeight() { return header_.height; }
+		inline int getBytespp() { return header_.bytespp; }
+
+		/*读取(x, y)开始w*h的区域 dst每行stride字节 文件被截断或损坏时抛出TiledFileReadException*/
+		void readRegion(int x, int y, int w, int h, unsigned char* dst, size_t stride) {
+			int bpp = header_.bytespp;
+			forEachSpan(x, y, w, h, [&](long long offset, int rx, int ry, int count) {
+				if (!seek(offset) || fread(dst + ry * stride + rx * bpp, bpp, count, file_) != (size_t)count)
+					throw TiledFileReadException("Cannot read a tiled file region");
+			});
+		}
+		/*磁盘已满等原因写入失败时抛出TiledFileWriteException*/
+		void writeRegion(int x, int y, int w, int h, const unsigned char* src, size_t stride) {
+			int bpp = header_.bytespp;
+			forEachSpan(x, y, w, h, [&](long long offset, int rx, int ry, int count) {
+				if (!seek(offset) || fwrite(src + ry * stride + rx * bpp, bpp, count, file_) != (size_t)count)
+					throw TiledFileWriteException("Cannot write a tiled file region");
+			});
+			/*缓冲中的数据在这里写出 否则错误要到析构时才发生而被忽略*/
+			if (fflush(file_) != 0) throw TiledFileWriteException("Cannot write a tiled file region");
+		}
+		/*逐块读取整幅图像求RGB平均值 内存占用与图像大小无关*/
+		Vec4f averageRGB() {
+			double sum[3] = { 0, 0, 0 };
+			int bpp = header_.bytespp, ts = header_.tile_size;
+			std::vector<unsigned char> tile((size_t)ts * ts * bpp);
+			for (int y = 0; y < header_.height; y += ts)
+				for (int x = 0; x < header_.width; x += ts) {
+					int w = std::min(ts, header_.width - x), h = std::min(ts, header_.height - y);
+					readRegion(x, y, w, h, tile.data(), (size_t)w * bpp);
+					for (size_t i = 0; i < (size_t)w * h; ++i)
+						for (int c = 0; c < 3 && c < bpp; ++c)
+							sum[c] += tile[i * bpp + c];
+				}
+			Vec4f avg(0, 0, 0, 0);
+			double count = (double)header_.width * header_.height;
+			if (count > 0)
+				for (int c = 0; c < 3; ++c)
+					avg[c] = sum[c] / count;
+			return avg;
+		}
+	};
+}
+
+#endif